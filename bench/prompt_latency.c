@@ -0,0 +1,202 @@
+/**
+ * Measures the latency a user perceives: the time from pressing Enter to the next prompt appearing.
+ * The shell runs on a pseudo-terminal, as it would in a terminal emulator; each scenario types a
+ * command line, waits for the prompt to come back and records how long that took.
+ *
+ * Build via make bench, giving build/release/prompt-latency
+ * Execute via build/release/prompt-latency [-n runs] [-w warmup] [-p prompt] [shell [args...]]
+ *
+ * The shell defaults to build/release/shell --norc. Its prompt is recognised by the text it ends
+ * with, "$ " unless -p says otherwise.
+ *
+ * @author Alex Jasper
+ * @version 04/22/2024
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define PROMPT_TIMEOUT_MS 10000 // Longest wait for a prompt before the shell is considered hung.
+
+/**
+ * A kind of command line whose prompt-to-prompt latency is measured.
+ */
+struct scenario
+{
+    const char *name;
+    const char *line;
+};
+
+static const struct scenario scenarios[] = {
+    {"empty line", ""},
+    {"builtin", "cd ."},
+    {"assignment", "X=1"},
+    {"external", "true"},
+    {"redirection", "echo hi > /dev/null"},
+    {"pipeline", "echo hi | cat | wc -c"},
+};
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Reads the shell's output until it ends with the prompt.
+ *
+ * @param fd The pseudo-terminal master.
+ * @param prompt The text the prompt ends with.
+ * @return false if the shell exited or no prompt came within PROMPT_TIMEOUT_MS.
+ */
+static bool wait_for_prompt(int fd, const char *prompt)
+{
+    char tail[256] = ""; // The last bytes of output, enough to hold the prompt's suffix.
+    size_t tail_len = 0, prompt_len = strlen(prompt);
+    double deadline = now_ms() + PROMPT_TIMEOUT_MS;
+    while (1)
+    {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int timeout = deadline - now_ms();
+        if (timeout <= 0 || poll(&pfd, 1, timeout) == 0)
+            return false;
+        char buf[4096];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        for (ssize_t i = 0; i < n; i++)
+        {
+            if (tail_len == sizeof(tail) - 1)
+            {
+                memmove(tail, tail + 1, tail_len - 1);
+                tail_len--;
+            }
+            tail[tail_len++] = buf[i];
+        }
+        tail[tail_len] = '\0';
+        if (tail_len >= prompt_len && strcmp(tail + tail_len - prompt_len, prompt) == 0)
+            return true;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Prints one row of the report: how many runs there were and the latency percentiles in milliseconds.
+ */
+static void report(const char *name, double samples[], size_t num_samples)
+{
+    qsort(samples, num_samples, sizeof(double), compare_doubles);
+    const double percentiles[] = {50, 90, 99};
+    printf("%-12s %6zu %8.3f", name, num_samples, samples[0]);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+        printf(" %8.3f", samples[(size_t)((num_samples - 1) * percentiles[i] / 100)]);
+    printf(" %8.3f\n", samples[num_samples - 1]);
+}
+
+int main(int argc, char *argv[])
+{
+    long runs = 200, warmup = 20;
+    const char *prompt = "$ ";
+    int opt;
+    while ((opt = getopt(argc, argv, "+n:w:p:")) != -1)
+    {
+        if (opt == 'n' && atol(optarg) > 0)
+            runs = atol(optarg);
+        else if (opt == 'w' && atol(optarg) >= 0)
+            warmup = atol(optarg);
+        else if (opt == 'p')
+            prompt = optarg;
+        else
+        {
+            fprintf(stderr, "usage: %s [-n runs] [-w warmup] [-p prompt] [shell [args...]]\n", argv[0]);
+            return 2;
+        }
+    }
+    char *default_shell[] = {"build/release/shell", "--norc", NULL};
+    char **shell = optind < argc ? argv + optind : default_shell;
+
+    struct termios term;
+    memset(&term, 0, sizeof(term));
+    cfmakeraw(&term);
+    term.c_iflag |= ICRNL;  // Enter sends a carriage return, which the terminal turns into a newline,
+    term.c_lflag |= ICANON; // and the shell reads whole lines; the typed text is not echoed back.
+    term.c_oflag |= OPOST | ONLCR;
+    int master;
+    pid_t pid = forkpty(&master, NULL, &term, NULL);
+    if (pid == -1)
+    {
+        perror("forkpty");
+        return 1;
+    }
+    if (pid == 0)
+    {
+        execvp(shell[0], shell);
+        perror(shell[0]);
+        _exit(127);
+    }
+
+    int status = 0;
+    if (!wait_for_prompt(master, prompt))
+    {
+        fprintf(stderr, "%s: no prompt ending in \"%s\"\n", shell[0], prompt);
+        status = 1;
+    }
+    double *samples = malloc(runs * sizeof(double));
+    if (!samples)
+    {
+        perror("malloc failed");
+        return 1;
+    }
+    if (status == 0)
+        printf("%-12s %6s %8s %8s %8s %8s %8s  (ms)\n", "scenario", "runs", "min", "p50", "p90", "p99", "max");
+    for (size_t s = 0; status == 0 && s < sizeof(scenarios) / sizeof(scenarios[0]); s++)
+    {
+        char line[256];
+        int len = snprintf(line, sizeof(line), "%s\r", scenarios[s].line);
+        for (long run = 0; run < warmup + runs; run++)
+        {
+            double start = now_ms();
+            if (write(master, line, len) != len || !wait_for_prompt(master, prompt))
+            {
+                fprintf(stderr, "%s: no prompt after \"%s\"\n", shell[0], scenarios[s].line);
+                status = 1;
+                break;
+            }
+            if (run >= warmup)
+                samples[run - warmup] = now_ms() - start;
+        }
+        if (status == 0)
+            report(scenarios[s].name, samples, runs);
+    }
+    free(samples);
+
+    if (write(master, "quit\r", 5) != 5)
+        kill(pid, SIGKILL);
+    for (int tries = 0; waitpid(pid, NULL, WNOHANG) == 0; tries++)
+    {
+        if (tries == 100) // The shell ignored quit for a second.
+            kill(pid, SIGKILL);
+        usleep(10000);
+    }
+    close(master);
+    return status;
+}
@@ -0,0 +1,458 @@
+/**
+ * Plays back a session recorded with build/release/shell --record file against a shell build, as a
+ * reproducible workload for comparing shell changes. Every session runs the recorded command lines
+ * in order, starting in the recorded working directory, and sends each one when it was typed in
+ * the recording (with -s, scaled; with -m, as soon as the prompt is back). The report gives the
+ * throughput, the prompt-to-prompt latency percentiles next to those of the recording, and the
+ * commands whose exit status differed from the recorded one.
+ *
+ * Build via make bench, giving build/release/replay
+ * Execute via build/release/replay [-c sessions] [-s scale | -m] [-l] recording [shell [args...]]
+ *
+ * The shell defaults to build/release/shell --norc. Each session is a shell reading from a pipe,
+ * with PS1 set so that every prompt carries $? between two \036 bytes, which is how the end of a
+ * command and its status are recognised. Standard error of the sessions is discarded. -l lists the
+ * recording instead of playing it back.
+ *
+ * @author Alex Jasper
+ * @version 04/22/2024
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define RECORDING_MAGIC "SHREC1\n" // Start of a recording; see struct session_recording in shell.c.
+#define PROMPT_MARK '\036'         // Surrounds $? in the prompt of a session.
+#define MISMATCHES_SHOWN 5         // Status mismatches listed in the report.
+
+/**
+ * One recorded command line.
+ */
+struct record
+{
+    double offset_ms;   // When it was submitted, from the first command line of the recording.
+    double duration_ms; // How long it took to get the prompt back when recorded.
+    int status;         // $? after it.
+    const char *cwd;    // The directory it was typed in.
+    char *line;
+};
+
+/**
+ * A shell playing back the recording.
+ */
+struct session
+{
+    pid_t pid;
+    int in_fd;         // The shell's standard input.
+    int out_fd;        // Its standard output, where prompts appear.
+    size_t next;       // Index of the next record to send.
+    bool running;      // A command line was sent and its prompt has not come back yet.
+    double sent_ms;    // When it was sent.
+    int mark_state;    // 0 outside a prompt mark, 1 after its opening \036 (reading $?).
+    int status;        // $? read so far.
+    bool done;
+};
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static bool read_varint(const unsigned char **p, const unsigned char *end, unsigned long long *value)
+{
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *(*p)++;
+        *value |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static char *read_string(const unsigned char **p, const unsigned char *end, unsigned long long len)
+{
+    if ((unsigned long long)(end - *p) < len)
+        return NULL;
+    char *str = strndup((const char *)*p, len);
+    *p += len;
+    return str;
+}
+
+/**
+ * Reads a recording.
+ *
+ * @param num_records Set to the number of records.
+ * @return The records, or NULL if the file could not be read or is not a recording (an error has been
+ *         printed).
+ */
+static struct record *load_recording(const char *path, size_t *num_records)
+{
+    FILE *file = fopen(path, "rb");
+    struct stat st;
+    if (!file || fstat(fileno(file), &st) == -1)
+    {
+        perror(path);
+        if (file)
+            fclose(file);
+        return NULL;
+    }
+    unsigned char *data = malloc(st.st_size + 1);
+    if (!data)
+    {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    size_t size = fread(data, 1, st.st_size, file);
+    fclose(file);
+    size_t magic_len = strlen(RECORDING_MAGIC);
+    if (size < magic_len || memcmp(data, RECORDING_MAGIC, magic_len) != 0)
+    {
+        fprintf(stderr, "%s: not a shell recording\n", path);
+        free(data);
+        return NULL;
+    }
+
+    struct record *records = NULL;
+    size_t len = 0, cap = 0;
+    const unsigned char *p = data + magic_len, *end = data + size;
+    const char *cwd = NULL;
+    double offset_ms = 0;
+    while (p < end)
+    {
+        unsigned long long gap_us, duration_us, status, cwd_len, line_len;
+        char *new_cwd = NULL, *line = NULL;
+        bool ok = read_varint(&p, end, &gap_us) && read_varint(&p, end, &duration_us) &&
+                  read_varint(&p, end, &status) && read_varint(&p, end, &cwd_len) &&
+                  (cwd_len == 0 || (new_cwd = read_string(&p, end, cwd_len))) && read_varint(&p, end, &line_len) &&
+                  (line = read_string(&p, end, line_len));
+        if (!ok)
+        {
+            fprintf(stderr, "%s: truncated after %zu records\n", path, len);
+            free(new_cwd);
+            break;
+        }
+        if (len == cap)
+        {
+            cap = cap ? cap * 2 : 256;
+            records = realloc(records, cap * sizeof(struct record));
+            if (!records)
+            {
+                perror("realloc failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (new_cwd)
+            cwd = new_cwd; // Kept for the life of the program, shared by the records that follow.
+        if (len > 0)
+            offset_ms += gap_us / 1e3;
+        records[len++] = (struct record){offset_ms, duration_us / 1e3, status, cwd, line};
+    }
+    free(data);
+    *num_records = len;
+    return records;
+}
+
+static void list_recording(const struct record records[], size_t num_records)
+{
+    printf("%10s %10s %6s  %s\n", "at (ms)", "took (ms)", "status", "command line");
+    for (size_t i = 0; i < num_records; i++)
+    {
+        if (i == 0 || records[i].cwd != records[i - 1].cwd)
+            printf("%30s  # in %s\n", "", records[i].cwd ? records[i].cwd : "?");
+        printf("%10.1f %10.3f %6d  %s\n", records[i].offset_ms, records[i].duration_ms, records[i].status,
+               records[i].line);
+    }
+}
+
+/**
+ * Starts a shell for a session, in the directory of the first record.
+ *
+ * @return false if it could not be started (an error has been printed).
+ */
+static bool start_session(struct session *session, char *shell[], const char *cwd)
+{
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1)
+    {
+        perror("pipe2");
+        return false;
+    }
+    session->pid = fork();
+    if (session->pid == -1)
+    {
+        perror("fork");
+        return false;
+    }
+    if (session->pid == 0)
+    {
+        if (cwd && chdir(cwd) == -1)
+        {
+            perror(cwd);
+            _exit(126);
+        }
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO); // A shell that fails to start shows up as exiting early.
+        setenv("PS1", "\\036\\?\\036", 1);
+        execvp(shell[0], shell);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    session->in_fd = in[1];
+    session->out_fd = out[0];
+    return true;
+}
+
+/**
+ * Reads a session's output, looking for prompts.
+ *
+ * @param prompt_status Set to $? as shown by the last complete prompt in the output read.
+ * @return 1 if a prompt was seen, 0 if not, -1 if the shell has exited.
+ */
+static int read_session(struct session *session, int *prompt_status)
+{
+    char buf[4096];
+    ssize_t n = read(session->out_fd, buf, sizeof(buf));
+    if (n == -1 && errno == EINTR)
+        return 0;
+    if (n <= 0)
+        return -1;
+    int seen = 0;
+    for (ssize_t i = 0; i < n; i++)
+    {
+        if (session->mark_state == 0)
+        {
+            if (buf[i] == PROMPT_MARK)
+            {
+                session->mark_state = 1;
+                session->status = 0;
+            }
+        }
+        else if (buf[i] >= '0' && buf[i] <= '9')
+        {
+            session->status = session->status * 10 + buf[i] - '0';
+        }
+        else if (buf[i] == PROMPT_MARK)
+        {
+            *prompt_status = session->status;
+            session->mark_state = 0;
+            seen = 1;
+        }
+        else
+        {
+            session->status = 0; // Not a prompt after all; a \036 may open the next one.
+            session->mark_state = buf[i] == PROMPT_MARK;
+        }
+    }
+    return seen;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Prints one row of latency percentiles in milliseconds.
+ */
+static void report(const char *name, double samples[], size_t num_samples)
+{
+    qsort(samples, num_samples, sizeof(double), compare_doubles);
+    const double percentiles[] = {50, 90, 99};
+    printf("%-10s %8.3f", name, samples[0]);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+        printf(" %8.3f", samples[(size_t)((num_samples - 1) * percentiles[i] / 100)]);
+    printf(" %8.3f\n", samples[num_samples - 1]);
+}
+
+int main(int argc, char *argv[])
+{
+    long num_sessions = 1;
+    double scale = 1; // 0 plays back at maximum speed.
+    bool list = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "+c:s:ml")) != -1)
+    {
+        if (opt == 'c' && atol(optarg) > 0)
+            num_sessions = atol(optarg);
+        else if (opt == 's' && atof(optarg) >= 0)
+            scale = atof(optarg);
+        else if (opt == 'm')
+            scale = 0;
+        else if (opt == 'l')
+            list = true;
+        else
+            optind = argc + 1;
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "usage: %s [-c sessions] [-s scale | -m] [-l] recording [shell [args...]]\n", argv[0]);
+        return 2;
+    }
+    size_t num_records;
+    struct record *records = load_recording(argv[optind], &num_records);
+    if (!records)
+        return 1;
+    if (list)
+    {
+        list_recording(records, num_records);
+        return 0;
+    }
+    if (num_records == 0)
+    {
+        fprintf(stderr, "%s: no command lines recorded\n", argv[optind]);
+        return 1;
+    }
+    char *default_shell[] = {"build/release/shell", "--norc", NULL};
+    char **shell = optind + 1 < argc ? argv + optind + 1 : default_shell;
+    char *shell_path = strchr(shell[0], '/') ? realpath(shell[0], NULL) : NULL;
+    if (shell_path)
+        shell[0] = shell_path; // The sessions start in the recorded directory.
+    signal(SIGPIPE, SIG_IGN);
+
+    struct session *sessions = calloc(num_sessions, sizeof(struct session));
+    struct pollfd *pfds = calloc(num_sessions, sizeof(struct pollfd));
+    double *latencies = malloc(num_sessions * num_records * sizeof(double));
+    if (!sessions || !pfds || !latencies)
+    {
+        perror("malloc failed");
+        return 1;
+    }
+    int status = 0;
+    for (long i = 0; i < num_sessions; i++)
+    {
+        if (!start_session(&sessions[i], shell, records[0].cwd))
+            return 1;
+        sessions[i].running = true; // Until the first prompt.
+    }
+
+    size_t num_latencies = 0, mismatches = 0;
+    long remaining = num_sessions;
+    double start = -1; // When the first prompt came, the time every session's schedule counts from.
+    while (remaining > 0)
+    {
+        double now = now_ms();
+        int timeout = -1;
+        for (long i = 0; i < num_sessions; i++)
+        {
+            struct session *session = &sessions[i];
+            pfds[i] = (struct pollfd){.fd = session->done ? -1 : session->out_fd, .events = POLLIN};
+            if (session->done || session->running || start < 0)
+                continue;
+            if (session->next == num_records)
+            {
+                close(session->in_fd); // The shell exits at the end of its input.
+                session->in_fd = -1;
+                session->running = true;
+                continue;
+            }
+            const struct record *record = &records[session->next];
+            double due = start + record->offset_ms * scale;
+            if (due > now)
+            {
+                if (timeout == -1 || due - now < timeout)
+                    timeout = due - now + 1;
+                continue;
+            }
+            size_t len = strlen(record->line);
+            record->line[len] = '\n'; // Briefly, so that the line goes out in one write.
+            bool sent = write(session->in_fd, record->line, len + 1) == (ssize_t)len + 1;
+            record->line[len] = '\0';
+            if (!sent)
+            {
+                fprintf(stderr, "session %ld: the shell stopped reading its input\n", i);
+                status = 1;
+            }
+            session->sent_ms = now_ms();
+            session->running = true;
+        }
+        if (poll(pfds, num_sessions, timeout) == -1 && errno != EINTR)
+        {
+            perror("poll");
+            return 1;
+        }
+        for (long i = 0; i < num_sessions; i++)
+        {
+            struct session *session = &sessions[i];
+            if (session->done || !(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            int prompt_status;
+            int seen = read_session(session, &prompt_status);
+            if (seen == 1 && session->in_fd != -1)
+            {
+                if (start < 0)
+                    start = now_ms();
+                if (session->sent_ms > 0)
+                {
+                    const struct record *record = &records[session->next++];
+                    latencies[num_latencies++] = now_ms() - session->sent_ms;
+                    if (prompt_status != record->status && mismatches++ < MISMATCHES_SHOWN)
+                        fprintf(stderr, "status %d, recorded %d: %s\n", prompt_status, record->status, record->line);
+                }
+                session->running = false;
+            }
+            else if (seen == -1)
+            {
+                if (session->in_fd != -1)
+                {
+                    fprintf(stderr, "session %ld: the shell exited after %zu command lines\n", i, session->next);
+                    status = 1;
+                    close(session->in_fd);
+                }
+                close(session->out_fd);
+                session->done = true;
+                remaining--;
+            }
+        }
+    }
+    double elapsed_ms = start < 0 ? 0 : now_ms() - start;
+    for (long i = 0; i < num_sessions; i++)
+    {
+        int shell_status;
+        waitpid(sessions[i].pid, &shell_status, 0);
+    }
+
+    printf("%ld session%s of %zu command lines: %zu run in %.3f s (recorded over %.3f s), %.1f per second\n",
+           num_sessions, num_sessions == 1 ? "" : "s", num_records, num_latencies, elapsed_ms / 1e3,
+           records[num_records - 1].offset_ms / 1e3, elapsed_ms > 0 ? num_latencies / (elapsed_ms / 1e3) : 0);
+    if (num_latencies > 0)
+    {
+        printf("%-10s %8s %8s %8s %8s %8s  (ms, prompt to prompt)\n", "", "min", "p50", "p90", "p99", "max");
+        report("replayed", latencies, num_latencies);
+        double *recorded = latencies; // No longer needed once reported.
+        for (size_t i = 0; i < num_records; i++)
+            recorded[i] = records[i].duration_ms;
+        report("recorded", recorded, num_records);
+    }
+    if (mismatches > 0)
+    {
+        printf("%zu command lines exited with a different status than when recorded\n", mismatches);
+        status = 1;
+    }
+    for (size_t i = 0; i < num_records; i++)
+        free(records[i].line);
+    free(records);
+    free(sessions);
+    free(pfds);
+    free(latencies);
+    free(shell_path);
+    return status;
+}
@@ -0,0 +1,7848 @@
+/**
+ * The shell's parser, pipeline executor, builtins and job control: the implementation of libshell
+ * (see shell.h). The interactive shell is the front end in main.c.
+ *
+ * @author Alex Jasper
+ * @version 04/22/2024
+ */
+
+#define _GNU_SOURCE // For F_GETPIPE_SZ, F_SETPIPE_SZ and splice().
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+#include <stdint.h>
+#include <link.h>
+#include <elf.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <pwd.h>
+#include <sys/resource.h>
+#include <dlfcn.h>
+#include <sched.h>
+#include <malloc.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include "shell.h"
+#include "shell_builtin.h"
+
+#define ADAPT_INTERVAL_MS 20           // How often adaptive pipe sizing samples the pipes of running jobs.
+#define ADAPT_DEFAULT_BUDGET (4 << 20) // Default PIPEBUDGET: total pipe capacity one job may grow to.
+#define EV_FALLBACK_POLL_MS 50         // Reaping interval for stages without a pidfd (kernels before 5.3).
+#define PATH_CACHE_BUCKETS 64          // Hash buckets of the PATH lookup cache.
+#define PREFETCH_DEPTH 2               // Levels of shared library dependencies warmed by prefetch.
+#define PREFETCH_REWARM_SECS 30        // A file warmed more recently than this is not warmed again.
+#define LINEBUF_MAX 65536              // Longest line buffered for a job before it is written out anyway.
+#define RATELIMIT_QUANTUM_MS 10        // ratelimit moves data in chunks worth this much time at the rate,
+#define RATELIMIT_BURST 4              // and lets this many chunks accumulate while its input is idle.
+#define RATELIMIT_BUF 65536            // Largest chunk ratelimit moves at once.
+#define AUDIT_QUEUE_SIZE 1024          // Records the audit queue holds (a power of two).
+#define AUDIT_FLUSH_MS 200             // How often the audit writer writes and fsyncs queued records.
+#define HISTORY_MAX 10000              // Commands kept in the history; the oldest are dropped first.
+#define CAPTURE_MAX (1 << 20)          // Output kept per stream of a machine-mode request.
+#define METRICS_IDLE_MS 10000          // A metrics client making no progress this long is disconnected.
+#define POOL_PRIORITIES 3              // Thread pool task priorities, 0 the most urgent.
+#define POOL_MAX_WORKERS 64            // Upper bound on thread pool workers however many CPUs there are.
+#define SPAWN_BUCKETS 10               // Buckets of the exported fork() latency histogram.
+#define HDR_SUB_BUCKET_BITS 8          // Latency histograms keep values to within 1/128 (under 1%),
+#define HDR_MAX_BITS 42                // up to 2^42 ns (73 minutes).
+#define PARSE_CACHE_SIZE 256           // Command lines whose words are kept by the parse cache,
+#define PARSE_CACHE_BUCKETS 512        // in this many hash buckets.
+#define PARSE_CACHE_LINE_MAX 4096      // Longer lines are parsed for every run rather than cached.
+#define PROMPT_DEFAULT "\\w$ "          // PS1 when it is not set: the working directory and a dollar sign.
+#define PROMPT_DEADLINE_MS 20          // Longest the prompt waits for a segment computed in the background.
+#define PROMPT_BRANCH_DIRS 16          // Directories whose git branch is cached.
+#define PROMPT_BRANCH_MAX 64           // Longest git branch name shown.
+#define SNAPSHOT_MAGIC "SHSNAP\0"       // Start of a startup snapshot file,
+#define SNAPSHOT_VERSION 3             // and the version of its layout, bumped whenever it changes.
+#define RECORDING_MAGIC "SHREC1\n"      // Start of a session recording (--record), read by bench/replay.c.
+#define HDR_SUB_BUCKETS (1 << HDR_SUB_BUCKET_BITS)
+#define HDR_COUNTS ((HDR_MAX_BITS - HDR_SUB_BUCKET_BITS + 2) * (HDR_SUB_BUCKETS / 2))
+
+/**
+ * A growable, always NUL terminated string buffer.
+ */
+struct strbuf
+{
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * A single command of a pipeline together with its redirections and, once it has run, its exit status.
+ */
+struct stage
+{
+    char **argv;       // NULL terminated argument vector.
+    size_t argc;       // Number of arguments in argv.
+    char *input_file;  // File named by '<', or NULL.
+    char *output_file; // File named by '>', or NULL.
+    char *path;        // Program path resolved through the PATH cache, or NULL to let execvp search.
+    struct rate_limiter *limiter; // State of a ratelimit stage, which runs inside the shell.
+    pid_t pid;         // Process running the stage, or -1 if it was never started.
+    int pidfd;         // pidfd of the process while it runs, or -1.
+    int status;        // Exit status, or 128 + signal number if the stage was killed.
+    int signal;        // Signal that terminated the stage, or 0.
+    bool finished;     // The stage's process has been reaped.
+    struct rusage usage; // Resources used by the stage's process, filled in when it is reaped.
+    int exec_fd;       // Read end of the stage's exec status pipe until its exec is seen, or -1.
+    struct timespec forked; // When the stage's process was forked.
+    int cancel_status; // Status for a stage killed because an earlier one could not exec, or 0.
+};
+
+/**
+ * Sizing state of the pipe between two stages, used by adaptive pipe sizing.
+ */
+struct pipe_edge
+{
+    int capacity;    // Current capacity in bytes.
+    int full_streak; // Consecutive samples in which the pipe was full.
+    int swings;      // Times the pipe went from full to empty or back since it was last grown.
+    bool was_full;   // State at the previous sample.
+    bool was_empty;
+    bool fixed;      // The kernel refused to grow this pipe further.
+};
+
+/**
+ * Output of a background job that the shell relays line by line (the linebuf option), so that lines
+ * of concurrently running jobs are never interleaved.
+ */
+struct output_relay
+{
+    int fd;                // Read end of the pipe the job writes to, or -1 after EOF.
+    int target;            // Where complete lines are written, or -1 to capture the output instead.
+    struct strbuf pending; // Output read but not yet written, at most LINEBUF_MAX bytes, or the
+                           // captured output, at most CAPTURE_MAX bytes.
+    bool truncated;        // Captured output exceeded CAPTURE_MAX and was cut off.
+    struct job *job;       // The job producing the output.
+};
+
+/**
+ * A job submitted as a JSON line in machine mode (--machine), with the settings that apply to it.
+ */
+struct machine_request
+{
+    char *id;        // The request's id as raw JSON text, echoed in the result.
+    char *cmd;       // Command line to parse, or NULL if argv was given.
+    char **argv;     // Pre-tokenised argument vector run as a single stage, NULL terminated.
+    size_t argc;
+    char *cwd;       // Directory to run in, or NULL for the shell's own.
+    char **env;      // NAME=value environment overrides.
+    size_t num_env;
+    double timeout;  // Seconds after which the job is killed, 0 for none.
+    int timer_fd;    // Timeout timer, or -1.
+    bool timed_out;
+    pid_t pgid;      // Process group of the forked stages and all they start, 0 until the first fork.
+};
+
+/**
+ * A ratelimit stage running inside the shell: a token bucket refilled at the configured rate, driven
+ * by the event loop, that passes data from in_fd to out_fd only while it has tokens.
+ */
+struct rate_limiter
+{
+    int in_fd;
+    int out_fd;
+    bool lines;        // Tokens are lines instead of bytes.
+    bool use_splice;   // Move bytes with splice() instead of read() and write().
+    double rate;       // Tokens added per second.
+    double quantum;    // Tokens worth RATELIMIT_QUANTUM_MS.
+    double tokens;     // Tokens available, at most RATELIMIT_BURST quanta.
+    struct timespec refilled;
+    int timer_fd;      // One-shot timer armed while waiting for tokens.
+    short in_events;   // Events currently watched on in_fd and out_fd.
+    short out_events;
+    int in_flags;      // File status flags of in_fd and out_fd before they were made non-blocking,
+    int out_flags;     // restored when the limiter is done, or -1 if left alone.
+    struct strbuf buf; // Data read but not written yet.
+    bool eof;          // in_fd reached EOF.
+    bool done;
+    int status;        // 0, or 1 on errors, or 128 + SIGPIPE if the output was closed.
+    struct job *job;   // The job and stage to finish when done, or NULL when run as a plain builtin.
+    struct stage *stage;
+};
+
+/**
+ * The counters perfstat opens on every stage, indexing perf_counters.
+ */
+enum perf_counter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    PERF_TASK_CLOCK,
+    PERF_PAGE_FAULTS,
+    PERF_COUNTERS
+};
+
+/**
+ * A perf_event_open() event counted by perfstat.
+ */
+struct perf_counter_spec
+{
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+/**
+ * The perfstat counters of one stage.
+ */
+struct perf_stage
+{
+    int fds[PERF_COUNTERS];       // Open counters while the stage runs, else -1.
+    double counts[PERF_COUNTERS]; // Final values, read when the stage is reaped.
+    int errors[PERF_COUNTERS];    // errno of counters that could not be opened or read, else 0.
+};
+
+/**
+ * A pipeline started by the shell. The foreground job is waited for right away; background jobs
+ * (started with a trailing '&') stay in the job table until they finish and have been reported.
+ */
+struct job
+{
+    int id;               // Job number shown as [id], 0 for the foreground job.
+    char *cmdline;        // The command as typed, for job listings.
+    struct stage *stages; // The stages of the pipeline, owned by the job.
+    size_t num_stages;
+    struct pipe_edge *edges; // The num_stages - 1 pipes between the stages.
+    size_t running;          // Stages started and not yet reaped.
+    bool background;
+    struct timespec started;        // CLOCK_MONOTONIC time the job was started,
+    struct timespec finished;       // and the time its last stage ended.
+    struct timespec submitted;      // Wall clock time the job was started, for the audit log.
+    char *cwd;                      // Working directory the job was started in, for the audit log.
+    struct output_relay *relays[2]; // Relayed or captured stdout and stderr, else NULL.
+    size_t open_relays;             // Relays that have not reached EOF yet.
+    struct machine_request *request; // The request that submitted the job in machine mode, or NULL.
+    int fds[3];              // Descriptors given to the job's standard streams, or -1 to inherit the shell's.
+    void (*on_finish)(struct job *job, int status, void *data); // Called instead of reporting the job
+    void *finish_data;                                          // at the prompt, or NULL.
+    struct perf_stage *perf; // Counters of each stage when run under perfstat, or NULL.
+    struct job *next;        // Next background job in the job table.
+};
+
+/**
+ * A descriptor watched by the event loop, with the callback to run when it becomes ready.
+ */
+struct ev_source
+{
+    int fd;
+    short events; // poll(2) events to wait for.
+    void (*callback)(int fd, short revents, void *data);
+    void *data;
+};
+
+/**
+ * The shell's event loop: everything the shell waits for (terminal input, timers, finished stages)
+ * is a descriptor polled in one place.
+ */
+struct event_loop
+{
+    struct ev_source *sources;
+    size_t num_sources;
+    size_t capacity;
+    unsigned long wakeups; // Number of times poll() returned.
+};
+
+/**
+ * Input read from standard input but not yet consumed as command lines.
+ */
+struct line_reader
+{
+    struct strbuf buf;
+    bool eof;
+};
+
+/**
+ * Resource usage of a process, read from /proc.
+ */
+struct proc_sample
+{
+    char state;               // R, S, D, Z, ...
+    unsigned long long ticks; // User + system CPU time in clock ticks.
+    long rss_pages;           // Resident set size.
+    unsigned long long rchar; // Bytes read, including from pipes and terminals.
+    unsigned long long wchar; // Bytes written.
+};
+
+/**
+ * State of a running jobtop view.
+ */
+struct jobtop_view
+{
+    long interval_ms;
+    long frames_left;           // Frames still to draw, or 0 to run until q is pressed.
+    bool quit;
+    pid_t *pids;                // Stages sampled in the previous frame,
+    unsigned long long *ticks;  // with the CPU time they had used by then.
+    size_t num_samples;
+    struct timespec last_frame; // When the previous frame was drawn.
+};
+
+/**
+ * The audit log. Records are formatted by the shell and handed to a writer thread through a
+ * single-producer, single-consumer lock-free ring, so running a command never waits for the disk; the
+ * writer batches the records into one write() and one fsync() every AUDIT_FLUSH_MS.
+ */
+struct audit_log
+{
+    bool enabled;
+    int fd;                          // The log file, opened for appending.
+    char *user;                      // Name of the user running the shell.
+    char *slots[AUDIT_QUEUE_SIZE];   // Queued records, one JSON line each.
+    _Atomic size_t head;             // Next slot the shell fills.
+    _Atomic size_t tail;             // Next slot the writer empties.
+    int wake_fd;                     // eventfd waking the writer before its next flush.
+    atomic_bool stop;                // Set on exit: the writer drains the queue and stops.
+    pthread_t thread;
+};
+
+/**
+ * A session recording (--record): every command line typed, for bench/replay.c to run again. Each
+ * record is a run of unsigned LEB128 varints and strings, which keeps a typical record to a few
+ * dozen bytes:
+ *
+ *     gap_us duration_us status cwd_len [cwd] line_len line
+ *
+ * gap_us is the time since the previous command line was submitted (since recording started for the
+ * first), duration_us how long it took to get the prompt back and status $? after it. The working
+ * directory is only stored when it differs from the previous record's; cwd_len is 0 otherwise.
+ */
+struct session_recording
+{
+    int fd;               // The recording, or -1 when not recording.
+    struct timespec last; // When the previous command line was submitted.
+    char *cwd;            // Working directory of the previous record.
+};
+
+/**
+ * A unit of in-process parallel work run by the shell-wide thread pool.
+ */
+struct pool_task
+{
+    void (*fn)(void *arg);
+    void *arg;
+    bool detached; // Freed by the pool when done instead of being waited for.
+    bool done;     // Guarded by the pool lock.
+};
+
+/**
+ * A double-ended queue of tasks, kept as a ring buffer.
+ */
+struct task_deque
+{
+    struct pool_task **items;
+    size_t cap;
+    size_t start;
+    size_t len;
+};
+
+/**
+ * A worker thread of the pool with its own queue per priority, which idle workers steal from.
+ */
+struct pool_worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock; // Guards queues.
+    struct task_deque queues[POOL_PRIORITIES];
+};
+
+/**
+ * The shell-wide work-stealing thread pool, started on first use. Builtins and shell features that
+ * parallelise their work submit it here instead of starting their own threads.
+ */
+struct thread_pool
+{
+    bool started;
+    struct pool_worker *workers;
+    size_t num_workers;
+    pthread_mutex_t lock;    // Guards the counters and task completion.
+    pthread_cond_t work;     // Signalled when a task is queued.
+    pthread_cond_t finished; // Broadcast when a task finishes.
+    size_t pending;          // Tasks queued and not yet taken.
+    _Atomic size_t next_worker; // Round robin position for tasks submitted from outside the pool.
+    unsigned long submitted;
+    unsigned long completed;
+    unsigned long steals;    // Tasks run by a worker other than the one they were queued on.
+};
+
+/**
+ * A high dynamic range histogram of latencies in nanoseconds: every power of two has its own linear
+ * sub-buckets, so percentiles keep the same relative precision from microseconds to minutes in a few
+ * kilobytes, and recording a value is a couple of instructions.
+ */
+struct hdr_histogram
+{
+    unsigned long counts[HDR_COUNTS];
+    unsigned long total;
+    uint64_t max;
+    double sum; // Of all recorded values, for averages.
+};
+
+/**
+ * Counters of the shell's own work, reported by shstat.
+ */
+struct shell_stats
+{
+    unsigned long commands_parsed;
+    unsigned long spawns_fork;    // Stages run in a forked child.
+    unsigned long spawns_shell;   // Builtins and ratelimit stages run inside the shell.
+    unsigned long spawn_failures; // Forks that failed.
+    unsigned long exec_failures;  // Forked stages whose program could not be executed.
+    size_t heap_high_water;       // Largest heap size seen, sampled as commands finish.
+    unsigned long exit_statuses[256];            // Commands finished, by exit status.
+    struct hdr_histogram spawn_latency;          // Time taken by fork(), the source of every report of it.
+    struct hdr_histogram exec_latency;           // Time from fork() to a successful exec.
+    struct hdr_histogram wall_time;              // Wall time of whole commands.
+};
+
+/**
+ * Where the shell exports its metrics in Prometheus text format.
+ */
+struct metrics_export
+{
+    char file[PATH_MAX];    // Rewritten periodically for a textfile collector, or empty.
+    char socket_path[108];  // Unix socket answering scrapes, or empty.
+    atomic_bool writing;    // A write of the file is in progress on the thread pool.
+};
+
+/**
+ * A scrape being answered on the metrics socket.
+ */
+struct metrics_client
+{
+    struct strbuf response;
+    size_t sent;
+    int fd;
+    int timer_fd; // Fires when the client has made no progress for METRICS_IDLE_MS.
+};
+
+/**
+ * A finished command in the history, with the resources it used.
+ */
+struct history_entry
+{
+    char *cmdline;
+    time_t start;  // Wall clock time the command was started.
+    double wall;   // Wall clock duration in seconds.
+    int status;    // Exit status, as in $?.
+    double cpu;    // User plus system CPU seconds of all its processes.
+    long maxrss;   // Largest resident set of any of its processes, in KiB.
+};
+
+/**
+ * Commands run so far, oldest first, at most HISTORY_MAX of them.
+ */
+struct history
+{
+    struct history_entry *entries;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * Options toggled with the 'set' builtin.
+ */
+struct shell_options
+{
+    bool pipefail;  // Pipeline status is the last non-zero stage status instead of the last stage's.
+    bool pipediag;  // Report each failing pipeline stage as soon as it exits.
+    bool adaptpipe; // Grow pipes that keep filling up while a pipeline runs.
+    bool prefetch;  // Warm the page cache for the command likely to be typed next.
+    bool linebuf;   // Relay background job output through the shell one whole line at a time.
+    bool jobtag;    // Prefix relayed lines with the job number.
+};
+
+/**
+ * A command name remembered by the PATH cache together with the program it resolved to.
+ */
+struct path_entry
+{
+    char *name;
+    char *path;
+    struct path_entry *next; // Next entry in the same hash bucket.
+};
+
+/**
+ * Resolved PATH lookups, so that starting a command does not search every PATH directory. The cache
+ * is flushed whenever PATH changes.
+ */
+struct path_cache
+{
+    struct path_entry *buckets[PATH_CACHE_BUCKETS];
+    char *path_var; // The PATH value the entries were resolved with.
+    unsigned long hits;
+    unsigned long misses;
+};
+
+/**
+ * How often one command was followed by another, learned from the commands run so far. Entries with a
+ * NULL prev count how often a command was run at all.
+ */
+struct command_transition
+{
+    char *prev;
+    char *next;
+    unsigned long count;
+    struct command_transition *link;
+};
+
+/**
+ * A file whose pages were recently prefetched.
+ */
+struct warmed_file
+{
+    char *path;
+    time_t when;
+    struct warmed_file *next;
+};
+
+/**
+ * A directory on the directory stack, or the one cd - returns to. It is held open with O_PATH, so
+ * returning to it is an fchdir() that resolves no path and still works after the path changes.
+ */
+struct dir_entry
+{
+    int fd;
+    char *path; // The directory's path when it was opened, for display.
+};
+
+/**
+ * The directories saved by pushd, with the most recently pushed one last. The current directory is
+ * not on the stack; dirs shows it first.
+ */
+struct dir_stack
+{
+    struct dir_entry *entries;
+    size_t len;
+    size_t cap;
+    struct dir_entry previous; // Where cd - goes, with fd -1 until the directory has changed.
+};
+
+/**
+ * A shell variable set with NAME=value.
+ */
+struct shell_var
+{
+    char *name;
+    char *value;
+    struct shell_var *next;
+};
+
+/**
+ * What a segment of the prompt shows.
+ */
+enum prompt_segment_kind
+{
+    PROMPT_LITERAL,    // Fixed text.
+    PROMPT_CWD,        // The working directory.
+    PROMPT_CWD_BASE,   // Its last component.
+    PROMPT_STATUS,     // Status of the last command.
+    PROMPT_JOBS,       // Number of background jobs.
+    PROMPT_TIME,       // The time of day.
+    PROMPT_GIT_BRANCH, // The git branch of the working directory, computed in the background.
+};
+
+struct prompt_segment
+{
+    enum prompt_segment_kind kind;
+    char *text; // The text of a literal segment, else NULL.
+};
+
+/**
+ * PS1 compiled into segments, so that drawing the prompt does not parse it again.
+ */
+struct compiled_prompt
+{
+    char *source; // The PS1 value the segments were compiled from.
+    struct prompt_segment *segments;
+    size_t num_segments;
+};
+
+/**
+ * The git branch of a directory, as last read on the thread pool.
+ */
+struct branch_entry
+{
+    char dir[PATH_MAX];
+    char branch[PROMPT_BRANCH_MAX];
+    unsigned long commands;  // stats.commands_parsed when the read was queued.
+    bool valid;              // The branch has been read at least once.
+    bool pending;            // A read is queued or running; the entry is not reused meanwhile.
+    unsigned long last_used; // For replacing the least recently used entry.
+};
+
+/**
+ * Git branches of recently visited directories, shared between the shell and pool workers.
+ */
+struct branch_cache
+{
+    struct branch_entry entries[PROMPT_BRANCH_DIRS];
+    unsigned long uses;
+    pthread_mutex_t lock;
+    pthread_cond_t done; // Signalled whenever a read finishes.
+};
+
+/**
+ * A command line remembered by the parse cache: the words it splits into and the templates of the
+ * stages they make up, from which every run expands its own stages.
+ */
+struct parse_entry
+{
+    uint64_t hash;
+    char *line;
+    bool aliases;              // Whether aliases were expanded (interactive lines) or not (requests).
+    char **words;              // The words, with aliases expanded if the line was an interactive one.
+    size_t num_words;
+    struct stage *stages;      // Unexpanded stage templates, parsed by the first run that needs them, or NULL.
+    size_t num_stages;
+    unsigned int uses;         // Runs of the line in progress, which keep it alive if it leaves the cache.
+    bool dropped;              // Not in the cache (evicted, invalidated or too long); freed after its last run.
+    struct parse_entry *next;  // Next entry in the same hash bucket.
+    struct parse_entry *newer; // Neighbours in the list from most to least recently used.
+    struct parse_entry *older;
+};
+
+/**
+ * Recently parsed command lines, so that a line typed or requested again skips splitting, alias
+ * expansion and building its stages. Variables are still expanded on every run, since their values
+ * change; aliases and options are not, so defining an alias or setting an option clears the cache.
+ */
+struct parse_cache
+{
+    struct parse_entry *buckets[PARSE_CACHE_BUCKETS];
+    struct parse_entry *newest;
+    struct parse_entry *oldest; // Evicted first when the cache is full.
+    size_t len;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+/**
+ * The header of a startup snapshot: the state an rc file set up, saved so that later shells can
+ * restore it instead of loading the file again. The header is followed by records of one kind byte
+ * and two strings, each a uint32_t length followed by that many bytes.
+ */
+struct snapshot_header
+{
+    char magic[8];        // SNAPSHOT_MAGIC.
+    uint32_t version;     // SNAPSHOT_VERSION.
+    uint32_t reserved;
+    uint64_t rc_dev;      // Identity of the rc file the snapshot was taken from,
+    uint64_t rc_ino;
+    uint64_t rc_size;
+    int64_t rc_mtime_ns;  // and its modification time.
+    uint64_t env_hash;    // Hash of the environment variables the rc file read, with their values.
+    uint64_t size;        // Size of the whole file, to detect truncation.
+};
+
+/**
+ * Kinds of snapshot records, with the strings each holds.
+ */
+enum snapshot_record
+{
+    SNAPSHOT_VAR = 1,   // Shell variable: name, value.
+    SNAPSHOT_ALIAS,     // Alias: name, words.
+    SNAPSHOT_OPTION,    // Option: name, "1" if on or "" if off.
+    SNAPSHOT_PATH_VAR,  // PATH the cache entries after it were resolved with: PATH, "".
+    SNAPSHOT_PATH_ENTRY, // PATH cache entry: command name, program path.
+    SNAPSHOT_CWD,       // Directories the rc file changed: working directory, where cd - goes, each
+                        // "" for the directory the shell started in.
+    SNAPSHOT_ENV,       // Environment variable the rc file read, in the order of env_hash: name, "".
+};
+
+/**
+ * The environment variables read while the rc file is loaded. Its snapshot is only valid in an
+ * environment where they have the same values, whatever the other variables are.
+ */
+struct env_reads
+{
+    bool active;   // The rc file is being loaded.
+    char **names;  // The variables, in the order they were first read.
+    size_t len;
+    uint64_t hash; // Hash of the names and the values they had when first read.
+};
+
+/**
+ * A named entry of the option table used by 'set -o' and 'set +o'.
+ */
+struct shell_option
+{
+    const char *name;
+    bool *flag;
+    const char *description;
+};
+
+/**
+ * A command handled inside the shell instead of being executed as a program.
+ */
+struct builtin
+{
+    const char *name;
+    int (*fn)(size_t argc, char *argv[]);
+    const char *usage;
+    const struct shell_builtin *loaded; // Set for builtins loaded with 'enable -f', which have no fn.
+};
+
+/**
+ * A builtin loaded from a shared object with 'enable -f'.
+ */
+struct loaded_builtin
+{
+    struct builtin builtin; // The entry find_builtin returns.
+    void *handle;           // dlopen handle of the shared object.
+    char *path;
+    struct loaded_builtin *next;
+};
+
+// Function prototypes
+static int find_pipe_idx(size_t num_args, char *args[]);
+static void execute_pipe(struct job *job);
+static void free_stages(struct stage *stages, size_t num_stages);
+static int builtin_cd(size_t argc, char *argv[]);
+static int builtin_pushd(size_t argc, char *argv[]);
+static int builtin_popd(size_t argc, char *argv[]);
+static int builtin_dirs(size_t argc, char *argv[]);
+static int builtin_set(size_t argc, char *argv[]);
+static int builtin_jobs(size_t argc, char *argv[]);
+static int builtin_wait(size_t argc, char *argv[]);
+static int builtin_pipestat(size_t argc, char *argv[]);
+static int builtin_jobtop(size_t argc, char *argv[]);
+static int builtin_hash(size_t argc, char *argv[]);
+static int builtin_ratelimit(size_t argc, char *argv[]);
+static int builtin_history(size_t argc, char *argv[]);
+static int builtin_slowest(size_t argc, char *argv[]);
+static int builtin_enable(size_t argc, char *argv[]);
+static int builtin_shstat(size_t argc, char *argv[]);
+static int builtin_latency(size_t argc, char *argv[]);
+static int builtin_perfstat(size_t argc, char *argv[]);
+static void read_perf_counters(struct perf_stage *perf);
+static int builtin_alias(size_t argc, char *argv[]);
+static int builtin_unalias(size_t argc, char *argv[]);
+static void push_string(char ***array, size_t *len, char *str);
+static void note_env_read(const char *name, const char *value);
+static void clear_parse_cache(void);
+static struct stage *line_stages(struct parse_entry *line, size_t num_args, char *args[], size_t *num_stages);
+static void parse_cmd(char *input);
+static void report_perf_counters(const struct job *job);
+static void hdr_record(struct hdr_histogram *hist, double ns);
+static void ev_remove(int fd);
+static size_t sample_heap_usage(size_t *in_use);
+static int open_pipe_edge(const struct job *job, size_t idx);
+static void free_rate_limiter(struct rate_limiter *limiter);
+static void rate_limiter_event(int fd, short revents, void *data);
+static void free_request(struct machine_request *request);
+static void finish_request(struct job *job, int status, void *data);
+static bool overrides_path(const struct machine_request *request);
+static bool apply_request(const struct machine_request *request);
+static void finish_command(const char *cmdline, const struct stage *stages, size_t num_stages, const char *cwd,
+                           struct timespec submitted, struct timespec started, struct timespec finished, int status);
+
+static struct shell_options options;
+
+static const struct shell_option option_table[] = {
+    {"pipefail", &options.pipefail, "pipeline status is the rightmost non-zero stage status"},
+    {"pipediag", &options.pipediag, "report failing pipeline stages as they exit"},
+    {"adaptpipe", &options.adaptpipe, "grow pipes that stay full, within PIPEBUDGET bytes per job"},
+    {"prefetch", &options.prefetch, "read ahead the binary and libraries of the likely next command"},
+    {"linebuf", &options.linebuf, "relay background job output in whole lines so jobs never interleave"},
+    {"jobtag", &options.jobtag, "prefix relayed background job output with [job]"},
+};
+
+static const struct builtin builtin_table[] = {
+    {"cd", builtin_cd, "cd <dir> | - - change the directory to <dir>, or back to the previous one"},
+    {"pushd", builtin_pushd,
+     "pushd [dir | +n] - save the directory and change to dir, swap with the saved top, or rotate"},
+    {"popd", builtin_popd, "popd [+n] - return to the most recently saved directory, or drop entry n"},
+    {"dirs", builtin_dirs, "dirs [-c] [-v] - list the saved directories, or clear them"},
+    {"set", builtin_set, "set [-o|+o option] - show or toggle shell options"},
+    {"jobs", builtin_jobs, "jobs - list background jobs"},
+    {"wait", builtin_wait, "wait [%job] - wait for background jobs to finish"},
+    {"pipestat", builtin_pipestat,
+     "pipestat [-i ms] [-n count] [%job] - show pipe fill and stage CPU of running jobs"},
+    {"jobtop", builtin_jobtop, "jobtop [-i ms] [-n count] - live view of running jobs, q to quit"},
+    {"hash", builtin_hash, "hash [-r] - list or forget the remembered command locations"},
+    {"ratelimit", builtin_ratelimit,
+     "ratelimit [-l] rate - pass input through at rate bytes (or with -l lines) per second"},
+    {"history", builtin_history, "history [count] - list commands with duration, status, CPU and memory"},
+    {"slowest", builtin_slowest,
+     "slowest [-c|-f] [-n count] [-s since] [-u until] - slowest, most CPU-hungry (-c) or most often\n"
+     "    failing (-f) commands, optionally limited to a time range such as -s 1h -u 10m"},
+    {"enable", builtin_enable, "enable [-f lib.so name | -d name] - list, load or unload loadable builtins"},
+    {"shstat", builtin_shstat, "shstat [-j] - show the shell's own counters, with -j as JSON"},
+    {"latency", builtin_latency, "latency [-r] - spawn, exec and command time percentiles, or reset them"},
+    {"perfstat", builtin_perfstat,
+     "perfstat command - count cycles, instructions, cache and branch misses and context switches of\n"
+     "    each stage of command"},
+    {"alias", builtin_alias, "alias [name[=words...]] - list, show or define aliases for command words"},
+    {"unalias", builtin_unalias, "unalias -a | name... - remove aliases"},
+};
+
+// Exit statuses of the stages of the most recent pipeline ($PIPESTATUS) and its overall status ($?).
+static int *pipe_status = NULL;
+static size_t num_pipe_status = 0;
+static int last_status = 0;
+
+static struct shell_var *var_table = NULL;
+static struct shell_var *alias_table = NULL; // Aliases, each name standing for its value's words.
+
+static struct job *job_table = NULL;      // Background jobs, ordered by job number.
+static struct job *foreground_job = NULL; // The job the shell is currently waiting for, if any.
+static int adapt_timer_fd = -1;           // Timer driving adaptive pipe sizing while jobs run.
+
+static struct path_cache path_cache;
+static struct dir_stack dir_stack = {.previous = {.fd = -1}};
+static struct parse_cache parse_cache;
+static struct compiled_prompt prompt;
+static struct branch_cache branch_cache = {.lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+static struct command_transition *command_model = NULL; // Learned command sequences used by prefetch.
+static char *last_command = NULL;                        // First command of the previous command line.
+static struct warmed_file *warmed_files = NULL;
+static unsigned long prefetched_files = 0;
+static unsigned long unsnapshotted_builtins = 0; // Builtins run with effects a snapshot cannot hold.
+static struct env_reads env_reads;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER; // Prefetching runs on the thread pool.
+static struct thread_pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .finished = PTHREAD_COND_INITIALIZER};
+static _Thread_local int current_worker = -1; // Index of the pool worker running the thread, or -1.
+
+static struct audit_log audit;
+static struct session_recording recording = {.fd = -1};
+static struct history history;
+static struct shell_stats stats;
+static const double spawn_bucket_bounds[SPAWN_BUCKETS] = {25e-6, 50e-6, 100e-6, 250e-6, 500e-6,
+                                                          1e-3,  2.5e-3, 5e-3, 10e-3, 50e-3}; // Seconds.
+static struct metrics_export metrics;
+static const struct perf_counter_spec perf_counters[PERF_COUNTERS] = {
+    [PERF_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_CACHE_MISSES] = {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [PERF_BRANCH_MISSES] = {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [PERF_CONTEXT_SWITCHES] = {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    [PERF_TASK_CLOCK] = {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    [PERF_PAGE_FAULTS] = {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+static struct loaded_builtin *loaded_builtins = NULL; // Builtins loaded with 'enable -f'.
+static volatile sig_atomic_t terminate_signal = 0; // SIGTERM or SIGHUP received while the audit log is on.
+
+static struct event_loop loop;
+static struct line_reader stdin_reader;
+
+/**
+ * Appends n bytes of str to the buffer, growing it as needed.
+ *
+ * @param sb The buffer to append to.
+ * @param str The bytes to append.
+ * @param n The number of bytes to append.
+ */
+static void strbuf_append(struct strbuf *sb, const char *str, size_t n)
+{
+    if (sb->len + n + 1 > sb->cap)
+    {
+        size_t cap = sb->cap ? sb->cap : 32;
+        while (cap < sb->len + n + 1)
+            cap *= 2;
+        sb->data = realloc(sb->data, cap);
+        if (!sb->data)
+        {
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        sb->cap = cap;
+    }
+    memcpy(sb->data + sb->len, str, n);
+    sb->len += n;
+    sb->data[sb->len] = '\0';
+}
+
+/**
+ * Appends printf-style formatted text to the buffer.
+ *
+ * @param sb The buffer to append to.
+ * @param fmt The printf format string.
+ */
+static void strbuf_appendf(struct strbuf *sb, const char *fmt, ...)
+{
+    char small[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(small, sizeof(small), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if ((size_t)n < sizeof(small))
+    {
+        strbuf_append(sb, small, n);
+        return;
+    }
+    char *large = malloc(n + 1);
+    if (!large)
+    {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    va_start(ap, fmt);
+    vsnprintf(large, n + 1, fmt, ap);
+    va_end(ap);
+    strbuf_append(sb, large, n);
+    free(large);
+}
+
+/**
+ * Appends a string as a quoted JSON string, escaping quotes, backslashes and control characters.
+ *
+ * @param sb The buffer to append to.
+ * @param str The string to quote.
+ */
+static void strbuf_append_json(struct strbuf *sb, const char *str)
+{
+    strbuf_append(sb, "\"", 1);
+    for (const char *p = str; *p; p++)
+    {
+        unsigned char c = *p;
+        if (c == '"' || c == '\\')
+        {
+            char escaped[2] = {'\\', c};
+            strbuf_append(sb, escaped, 2);
+        }
+        else if (c == '\n')
+            strbuf_append(sb, "\\n", 2);
+        else if (c == '\t')
+            strbuf_append(sb, "\\t", 2);
+        else if (c < 0x20)
+            strbuf_appendf(sb, "\\u%04x", c);
+        else
+            strbuf_append(sb, p, 1);
+    }
+    strbuf_append(sb, "\"", 1);
+}
+
+static bool is_valid_redirection(size_t i, size_t num_args, char *args[])
+{
+    // Returns true if there is a valid argument after the redirection symbol and it's not another redirection symbol.
+    return i + 1 < num_args && args[i + 1][0] != '<' && args[i + 1][0] != '>';
+}
+
+/**
+ * Scans the command arguments for input redirection symbol ('<') and modifies the command arguments to
+ * exclude the redirection syntax, while also setting the input redirection file.
+ *
+ * @param num_args Pointer to the number of arguments.
+ * @param args Array of argument strings.
+ * @param input_file Pointer to a string pointer, set to the input file name if redirection is found.
+ * @return true if input redirection is found and set, false otherwise.
+ */
+static bool redirect_input(size_t *num_args, char *args[], char **input_file)
+{
+    for (size_t i = 0; i < *num_args; i++)
+    {
+        if (strcmp(args[i], "<") == 0)
+        {
+            if (!is_valid_redirection(i, *num_args, args))
+            {
+                fprintf(stderr, "Syntax error near unexpected token `%s'\n", args[i + 1]);
+                return false;
+            }
+            *input_file = strdup(args[i + 1]);
+            for (size_t j = i; j < *num_args - 2; j++)
+            {
+                args[j] = args[j + 2];
+            }
+            *num_args -= 2;         // Adjust the number of arguments.
+            args[*num_args] = NULL; // Null terminate the modified argument list.
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Scans the command arguments for output redirection symbol ('>') and modifies the command arguments to
+ * exclude the redirection syntax, while also setting the output redirection file.
+ *
+ * @param num_args Pointer to the number of arguments.
+ * @param args Array of argument strings.
+ * @param output_file Pointer to a string pointer, set to the output file name if redirection is found.
+ * @return true if output redirection is found and set, false otherwise.
+ */
+static bool redirect_output(size_t *num_args, char *args[], char **output_file)
+{
+    for (size_t i = 0; i < *num_args; i++)
+    {
+        if (strcmp(args[i], ">") == 0)
+        {
+            if (!is_valid_redirection(i, *num_args, args))
+            {
+                fprintf(stderr, "Syntax error near unexpected token `%s'\n", args[i + 1]);
+                return false;
+            }
+            *output_file = strdup(args[i + 1]);
+            for (size_t j = i; j < *num_args - 2; j++)
+            {
+                args[j] = args[j + 2];
+            }
+            *num_args -= 2;
+            args[*num_args] = NULL;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Opens path and installs it as file descriptor target, as done for '<' and '>' redirections.
+ *
+ * @param path The file to open.
+ * @param flags The open(2) flags.
+ * @param target The descriptor to replace (STDIN_FILENO or STDOUT_FILENO).
+ * @return 0 on success, -1 if the file could not be opened (an error has been printed).
+ */
+static int redirect_fd(const char *path, int flags, int target)
+{
+    int fd = open(path, flags, 0666);
+    if (fd == -1)
+    {
+        perror(target == STDIN_FILENO ? "Failed to redirect input" : "Failed to redirect output");
+        return -1;
+    }
+    if (fd != target)
+    {
+        dup2(fd, target);
+        close(fd);
+    }
+    return 0;
+}
+
+/**
+ * Looks up a variable, first among the shell variables and then in the environment.
+ *
+ * @param name The variable name.
+ * @return The value, or NULL if the variable is not set.
+ */
+static const char *get_var(const char *name)
+{
+    for (struct shell_var *var = var_table; var; var = var->next)
+    {
+        if (strcmp(var->name, name) == 0)
+            return var->value;
+    }
+    const char *value = getenv(name);
+    if (env_reads.active)
+        note_env_read(name, value);
+    return value;
+}
+
+/**
+ * Sets a shell variable. A variable that came from the environment is updated there too, so that
+ * commands started afterwards see the new value.
+ *
+ * @param name The variable name.
+ * @param value The new value.
+ */
+static void set_var(const char *name, const char *value)
+{
+    if (getenv(name))
+        setenv(name, value, 1);
+    for (struct shell_var *var = var_table; var; var = var->next)
+    {
+        if (strcmp(var->name, name) == 0)
+        {
+            free(var->value);
+            var->value = strdup(value);
+            return;
+        }
+    }
+    struct shell_var *var = malloc(sizeof(struct shell_var));
+    if (!var)
+    {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    var->name = strdup(name);
+    var->value = strdup(value);
+    var->next = var_table;
+    var_table = var;
+}
+
+/**
+ * Checks whether a word has the form NAME=value.
+ *
+ * @param word The word to check.
+ * @return The length of NAME, or 0 if the word is not an assignment.
+ */
+static size_t assignment_name_len(const char *word)
+{
+    if (!isalpha((unsigned char)word[0]) && word[0] != '_')
+        return 0;
+    size_t len = 1;
+    while (isalnum((unsigned char)word[len]) || word[len] == '_')
+        len++;
+    return word[len] == '=' ? len : 0;
+}
+
+/**
+ * Parses a byte count with an optional K, M or G suffix (powers of 1024).
+ *
+ * @param str The text to parse.
+ * @param bytes Set to the parsed value.
+ * @return true if str is a valid size.
+ */
+static bool parse_size(const char *str, long *bytes)
+{
+    char *end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (end == str || value < 0 || errno != 0)
+        return false;
+    switch (toupper((unsigned char)*end))
+    {
+    case 'G':
+        value <<= 10;
+        // Fall through.
+    case 'M':
+        value <<= 10;
+        // Fall through.
+    case 'K':
+        value <<= 10;
+        end++;
+        break;
+    }
+    *bytes = value;
+    return *end == '\0';
+}
+
+/**
+ * Appends the value of a variable reference to out. PIPESTATUS is the array of exit statuses of the
+ * stages of the most recent pipeline: a subscript of '@' or '*' expands to all of them separated by
+ * spaces, a number to that element, and no subscript to the first element. Any other name is looked
+ * up with get_var.
+ *
+ * @param out The buffer receiving the value.
+ * @param name The variable name (not NUL terminated).
+ * @param name_len The length of name.
+ * @param subscript The text between '[' and ']', or NULL.
+ */
+static void expand_variable(struct strbuf *out, const char *name, size_t name_len, const char *subscript)
+{
+    if (name_len == 10 && strncmp(name, "PIPESTATUS", 10) == 0)
+    {
+        if (subscript && (strcmp(subscript, "@") == 0 || strcmp(subscript, "*") == 0))
+        {
+            for (size_t i = 0; i < num_pipe_status; i++)
+                strbuf_appendf(out, i ? " %d" : "%d", pipe_status[i]);
+            return;
+        }
+        char *end;
+        long idx = subscript ? strtol(subscript, &end, 10) : 0;
+        if (subscript && (*subscript == '\0' || *end != '\0'))
+            return;
+        if (idx >= 0 && (size_t)idx < num_pipe_status)
+            strbuf_appendf(out, "%d", pipe_status[idx]);
+        return;
+    }
+    char *key = strndup(name, name_len);
+    const char *value = get_var(key);
+    if (value)
+        strbuf_append(out, value, strlen(value));
+    free(key);
+}
+
+/**
+ * Expands $?, $NAME, ${NAME} and ${PIPESTATUS[i]} references in a word. A '$' that does not start a
+ * valid reference is kept literally.
+ *
+ * @param word The word to expand.
+ * @return A newly allocated string holding the expansion.
+ */
+static char *expand_word(const char *word)
+{
+    struct strbuf out = {0};
+    strbuf_append(&out, "", 0);
+    const char *p = word;
+    while (*p)
+    {
+        if (*p != '$')
+        {
+            strbuf_append(&out, p++, 1);
+            continue;
+        }
+        if (p[1] == '?')
+        {
+            strbuf_appendf(&out, "%d", last_status);
+            p += 2;
+            continue;
+        }
+        bool braced = p[1] == '{';
+        const char *name = p + (braced ? 2 : 1);
+        size_t name_len = 0;
+        while (isalnum((unsigned char)name[name_len]) || name[name_len] == '_')
+            name_len++;
+        const char *end = name + name_len;
+        char *subscript = NULL;
+        if (braced && name_len > 0 && *end == '[')
+        {
+            const char *close = strchr(end, ']');
+            if (close)
+            {
+                subscript = strndup(end + 1, close - end - 1);
+                end = close + 1;
+            }
+        }
+        if (name_len == 0 || (braced && *end != '}'))
+        {
+            strbuf_append(&out, p++, 1); // Not a reference, keep the '$'.
+            free(subscript);
+            continue;
+        }
+        expand_variable(&out, name, name_len, subscript);
+        free(subscript);
+        p = braced ? end + 1 : end;
+    }
+    return out.data;
+}
+
+/**
+ * Hashes a string with 64-bit FNV-1a.
+ *
+ * @param str The string to hash.
+ * @return The hash value.
+ */
+static uint64_t hash_string(const char *str)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *str; str++)
+    {
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Forgets every remembered command location.
+ */
+static void clear_path_cache(void)
+{
+    for (size_t i = 0; i < PATH_CACHE_BUCKETS; i++)
+    {
+        while (path_cache.buckets[i])
+        {
+            struct path_entry *entry = path_cache.buckets[i];
+            path_cache.buckets[i] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+    free(path_cache.path_var);
+    path_cache.path_var = NULL;
+}
+
+/**
+ * Resolves a command name to the program execvp would run, searching PATH only on a cache miss. Names
+ * containing a '/' are not looked up, and names that are not found are not remembered.
+ *
+ * @param name The command name.
+ * @return The program path, owned by the cache, or NULL if the name is not found on PATH.
+ */
+static const char *resolve_command(const char *name)
+{
+    if (strchr(name, '/') || *name == '\0')
+        return NULL;
+    const char *path_var = getenv("PATH");
+    if (!path_var)
+        path_var = "/bin:/usr/bin"; // execvp's default search path.
+    if (!path_cache.path_var || strcmp(path_cache.path_var, path_var) != 0)
+    {
+        clear_path_cache();
+        path_cache.path_var = strdup(path_var);
+    }
+
+    struct path_entry **bucket = &path_cache.buckets[hash_string(name) % PATH_CACHE_BUCKETS];
+    for (struct path_entry *entry = *bucket; entry; entry = entry->next)
+    {
+        if (strcmp(entry->name, name) == 0)
+        {
+            path_cache.hits++;
+            return entry->path;
+        }
+    }
+    path_cache.misses++;
+
+    const char *dir = path_var;
+    while (1)
+    {
+        size_t dir_len = strcspn(dir, ":");
+        char candidate[PATH_MAX];
+        int len = snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)(dir_len ? dir_len : 1),
+                           dir_len ? dir : ".", name); // An empty element means the current directory.
+        struct stat st;
+        if (len < (int)sizeof(candidate) && stat(candidate, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(candidate, X_OK) == 0)
+        {
+            struct path_entry *entry = malloc(sizeof(struct path_entry));
+            if (!entry)
+            {
+                perror("malloc failed");
+                exit(EXIT_FAILURE);
+            }
+            entry->name = strdup(name);
+            entry->path = strdup(candidate);
+            entry->next = *bucket;
+            *bucket = entry;
+            return entry->path;
+        }
+        if (dir[dir_len] == '\0')
+            return NULL;
+        dir += dir_len + 1;
+    }
+}
+
+/**
+ * Lists the remembered command locations, or forgets them all with -r.
+ */
+static int builtin_hash(size_t argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "-r") == 0)
+    {
+        clear_path_cache();
+        return 0;
+    }
+    for (size_t i = 0; i < PATH_CACHE_BUCKETS; i++)
+    {
+        for (struct path_entry *entry = path_cache.buckets[i]; entry; entry = entry->next)
+            printf("%s\t%s\n", entry->name, entry->path);
+    }
+    printf("hits %lu, misses %lu\n", path_cache.hits, path_cache.misses);
+    return 0;
+}
+
+/**
+ * Counts one occurrence of a command transition in the prefetch model.
+ *
+ * @param prev The previous command, or NULL to count the command on its own.
+ * @param next The command that was run.
+ */
+static void count_transition(const char *prev, const char *next)
+{
+    for (struct command_transition *t = command_model; t; t = t->link)
+    {
+        if (((!prev && !t->prev) || (prev && t->prev && strcmp(prev, t->prev) == 0)) && strcmp(next, t->next) == 0)
+        {
+            t->count++;
+            return;
+        }
+    }
+    struct command_transition *t = malloc(sizeof(struct command_transition));
+    if (!t)
+    {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    t->prev = prev ? strdup(prev) : NULL;
+    t->next = strdup(next);
+    t->count = 1;
+    t->link = command_model;
+    command_model = t;
+}
+
+/**
+ * Teaches the prefetch model that a command was run after the previous one.
+ *
+ * @param name The first command of the command line being run.
+ */
+static void learn_command(const char *name)
+{
+    count_transition(NULL, name);
+    if (last_command)
+        count_transition(last_command, name);
+    free(last_command);
+    last_command = strdup(name);
+}
+
+/**
+ * Predicts the next command: the one that most often followed the previous command, or failing that
+ * the most frequently run command overall.
+ *
+ * @return The predicted command name, owned by the model, or NULL with no history.
+ */
+static const char *predict_command(void)
+{
+    const struct command_transition *best = NULL, *best_overall = NULL;
+    for (const struct command_transition *t = command_model; t; t = t->link)
+    {
+        if (!t->prev && (!best_overall || t->count > best_overall->count))
+            best_overall = t;
+        if (t->prev && last_command && strcmp(t->prev, last_command) == 0 && (!best || t->count > best->count))
+            best = t;
+    }
+    best = best ? best : best_overall;
+    return best ? best->next : NULL;
+}
+
+/**
+ * Reads bytes from a file at an offset, failing on short reads.
+ */
+static bool read_exact(int fd, void *buf, size_t len, off_t offset)
+{
+    return pread(fd, buf, len, offset) == (ssize_t)len;
+}
+
+/**
+ * Reads the shared libraries an ELF file needs (its DT_NEEDED entries) and its run path.
+ *
+ * @param fd The open ELF file.
+ * @param needed Receives the library names, one allocated string per element.
+ * @param max_needed The capacity of needed.
+ * @param run_path Receives the allocated DT_RUNPATH (or DT_RPATH), or NULL.
+ * @return The number of libraries stored in needed.
+ */
+static size_t read_elf_needed(int fd, char *needed[], size_t max_needed, char **run_path)
+{
+    ElfW(Ehdr) ehdr;
+    *run_path = NULL;
+    if (!read_exact(fd, &ehdr, sizeof(ehdr), 0) || memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr.e_ident[EI_CLASS] != (sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32) ||
+        ehdr.e_phentsize != sizeof(ElfW(Phdr)) || ehdr.e_phnum == 0 || ehdr.e_phnum > 64)
+        return 0;
+    ElfW(Phdr) phdrs[ehdr.e_phnum];
+    if (!read_exact(fd, phdrs, sizeof(phdrs), ehdr.e_phoff))
+        return 0;
+
+    const ElfW(Phdr) *dynamic = NULL;
+    for (size_t i = 0; i < ehdr.e_phnum; i++)
+    {
+        if (phdrs[i].p_type == PT_DYNAMIC)
+            dynamic = &phdrs[i];
+    }
+    if (!dynamic || dynamic->p_filesz == 0 || dynamic->p_filesz > 65536)
+        return 0; // Statically linked, or not something we want to parse.
+    size_t num_dyn = dynamic->p_filesz / sizeof(ElfW(Dyn));
+    ElfW(Dyn) *dyn = malloc(num_dyn * sizeof(ElfW(Dyn)));
+    if (!dyn || !read_exact(fd, dyn, num_dyn * sizeof(ElfW(Dyn)), dynamic->p_offset))
+    {
+        free(dyn);
+        return 0;
+    }
+
+    // The string table is given by address; map it to a file offset through the PT_LOAD segments.
+    ElfW(Addr) strtab_addr = 0;
+    size_t strtab_size = 0;
+    for (size_t i = 0; i < num_dyn && dyn[i].d_tag != DT_NULL; i++)
+    {
+        if (dyn[i].d_tag == DT_STRTAB)
+            strtab_addr = dyn[i].d_un.d_ptr;
+        else if (dyn[i].d_tag == DT_STRSZ)
+            strtab_size = dyn[i].d_un.d_val;
+    }
+    off_t strtab_offset = -1;
+    for (size_t i = 0; i < ehdr.e_phnum; i++)
+    {
+        if (phdrs[i].p_type == PT_LOAD && strtab_addr >= phdrs[i].p_vaddr &&
+            strtab_addr < phdrs[i].p_vaddr + phdrs[i].p_filesz)
+            strtab_offset = phdrs[i].p_offset + (strtab_addr - phdrs[i].p_vaddr);
+    }
+    char *strtab = strtab_size > 0 && strtab_size <= (1 << 20) ? malloc(strtab_size + 1) : NULL;
+    size_t count = 0;
+    if (strtab && strtab_offset >= 0 && read_exact(fd, strtab, strtab_size, strtab_offset))
+    {
+        strtab[strtab_size] = '\0';
+        for (size_t i = 0; i < num_dyn && dyn[i].d_tag != DT_NULL; i++)
+        {
+            if (dyn[i].d_un.d_val >= strtab_size)
+                continue;
+            const char *str = strtab + dyn[i].d_un.d_val;
+            if (dyn[i].d_tag == DT_NEEDED && count < max_needed)
+                needed[count++] = strdup(str);
+            else if ((dyn[i].d_tag == DT_RUNPATH || (dyn[i].d_tag == DT_RPATH && !*run_path)))
+            {
+                free(*run_path);
+                *run_path = strdup(str);
+            }
+        }
+    }
+    free(strtab);
+    free(dyn);
+    return count;
+}
+
+/**
+ * Searches a colon separated directory list for a library, expanding $ORIGIN.
+ *
+ * @param dirs The directory list, may be NULL.
+ * @param name The library file name.
+ * @param origin The directory of the object that needs the library.
+ * @param found Receives the library's path.
+ * @return true if the library exists in one of the directories.
+ */
+static bool search_library_dirs(const char *dirs, const char *name, const char *origin, char found[PATH_MAX])
+{
+    while (dirs && *dirs)
+    {
+        size_t len = strcspn(dirs, ":");
+        if (len >= 7 && strncmp(dirs, "$ORIGIN", 7) == 0)
+            snprintf(found, PATH_MAX, "%s%.*s/%s", origin, (int)(len - 7), dirs + 7, name);
+        else
+            snprintf(found, PATH_MAX, "%.*s/%s", (int)len, dirs, name);
+        if (access(found, R_OK) == 0)
+            return true;
+        dirs += len + (dirs[len] == ':');
+    }
+    return false;
+}
+
+/**
+ * Collects the directories the shell's own shared libraries were loaded from, which are the dynamic
+ * linker's default directories on this system.
+ */
+static int collect_library_dir(struct dl_phdr_info *info, size_t size, void *data)
+{
+    struct strbuf *dirs = data;
+    const char *slash = strrchr(info->dlpi_name, '/');
+    if (info->dlpi_name[0] != '/' || !slash)
+        return 0;
+    size_t len = slash - info->dlpi_name;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", (int)len, info->dlpi_name);
+    if (!strstr(dirs->data, dir))
+        strbuf_appendf(dirs, ":%s", dir);
+    return 0;
+}
+
+/**
+ * Finds a shared library the way the dynamic linker would: LD_LIBRARY_PATH, then the run path of the
+ * object needing it, then the system library directories.
+ *
+ * @param name The DT_NEEDED name.
+ * @param run_path The run path of the needing object, or NULL.
+ * @param origin The directory of the needing object.
+ * @param found Receives the library's path.
+ * @return true if the library was found.
+ */
+static bool find_library(const char *name, const char *run_path, const char *origin, char found[PATH_MAX])
+{
+    static struct strbuf system_dirs = {0};
+    if (strchr(name, '/'))
+    {
+        snprintf(found, PATH_MAX, "%s", name);
+        return access(found, R_OK) == 0;
+    }
+    if (!system_dirs.data)
+    {
+        strbuf_append(&system_dirs, "/lib64:/usr/lib64:/lib:/usr/lib:/usr/local/lib", 46);
+        dl_iterate_phdr(collect_library_dir, &system_dirs);
+    }
+    return search_library_dirs(getenv("LD_LIBRARY_PATH"), name, origin, found) ||
+           search_library_dirs(run_path, name, origin, found) ||
+           search_library_dirs(system_dirs.data, name, origin, found);
+}
+
+/**
+ * Reads the CPU limit of the shell's cgroup and its ancestors: cpu.max with cgroup v2, or
+ * cpu.cfs_quota_us and cpu.cfs_period_us with cgroup v1.
+ *
+ * @return The tightest limit in CPUs, rounded up, or 0 if there is none.
+ */
+static size_t cgroup_cpu_limit(void)
+{
+    FILE *file = fopen("/proc/self/cgroup", "r");
+    if (!file)
+        return 0;
+    char line[PATH_MAX], dir[PATH_MAX + 64];
+    size_t limit = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\n")] = '\0';
+        char *controllers = strchr(line, ':');
+        char *path = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (!path)
+            continue;
+        *path++ = '\0';
+        controllers++;
+        bool v2 = *controllers == '\0';
+        if (!v2 && !strstr(controllers, "cpu"))
+            continue;
+        // Inside a container the cgroup is usually mounted at its own root, so fall back to that.
+        for (int attempt = 0; attempt < 2; attempt++)
+        {
+            const char *relative = attempt == 0 ? path : "";
+            if (v2)
+                snprintf(dir, sizeof(dir), "/sys/fs/cgroup%s", relative);
+            else
+                snprintf(dir, sizeof(dir), "/sys/fs/cgroup/%s%s", controllers, relative);
+            while (1)
+            {
+                char file_name[PATH_MAX + 96];
+                long long quota = -1, period = 0;
+                if (v2)
+                {
+                    snprintf(file_name, sizeof(file_name), "%s/cpu.max", dir);
+                    FILE *max = fopen(file_name, "r");
+                    if (max && fscanf(max, "%lld %lld", &quota, &period) != 2)
+                        quota = -1; // "max 100000": no limit at this level.
+                    if (max)
+                        fclose(max);
+                }
+                else
+                {
+                    snprintf(file_name, sizeof(file_name), "%s/cpu.cfs_quota_us", dir);
+                    FILE *f = fopen(file_name, "r");
+                    if (f && fscanf(f, "%lld", &quota) != 1)
+                        quota = -1;
+                    if (f)
+                        fclose(f);
+                    snprintf(file_name, sizeof(file_name), "%s/cpu.cfs_period_us", dir);
+                    f = fopen(file_name, "r");
+                    if (f && fscanf(f, "%lld", &period) != 1)
+                        period = 0;
+                    if (f)
+                        fclose(f);
+                }
+                if (quota > 0 && period > 0)
+                {
+                    size_t cpus = (quota + period - 1) / period;
+                    if (limit == 0 || cpus < limit)
+                        limit = cpus;
+                }
+                char *slash = strrchr(dir, '/');
+                if (!slash || slash - dir <= (long)strlen("/sys/fs/cgroup"))
+                    break;
+                *slash = '\0';
+            }
+        }
+    }
+    fclose(file);
+    return limit;
+}
+
+/**
+ * Adds a task at the back of a deque.
+ */
+static void deque_push(struct task_deque *deque, struct pool_task *task)
+{
+    if (deque->len == deque->cap)
+    {
+        size_t cap = deque->cap ? deque->cap * 2 : 16;
+        struct pool_task **items = malloc(cap * sizeof(struct pool_task *));
+        if (!items)
+        {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < deque->len; i++)
+            items[i] = deque->items[(deque->start + i) % deque->cap];
+        free(deque->items);
+        deque->items = items;
+        deque->cap = cap;
+        deque->start = 0;
+    }
+    deque->items[(deque->start + deque->len++) % deque->cap] = task;
+}
+
+/**
+ * Takes a task from a deque: its owner takes the newest task, whose data is most likely still in its
+ * cache, while thieves take the oldest.
+ *
+ * @param deque The deque, locked by the caller.
+ * @param newest Take from the back instead of the front.
+ * @return The task, or NULL if the deque is empty.
+ */
+static struct pool_task *deque_take(struct task_deque *deque, bool newest)
+{
+    if (deque->len == 0)
+        return NULL;
+    deque->len--;
+    if (newest)
+        return deque->items[(deque->start + deque->len) % deque->cap];
+    struct pool_task *task = deque->items[deque->start];
+    deque->start = (deque->start + 1) % deque->cap;
+    return task;
+}
+
+/**
+ * Finds the next task to run: the most urgent priority first, and within a priority the worker's own
+ * deque before stealing from the others.
+ *
+ * @param self The calling worker, or -1 for a thread outside the pool that is helping out.
+ * @return The task, or NULL if there is no queued task.
+ */
+static struct pool_task *take_task(int self)
+{
+    for (int priority = 0; priority < POOL_PRIORITIES; priority++)
+    {
+        for (size_t i = 0; i < pool.num_workers; i++)
+        {
+            size_t victim = ((self < 0 ? 0 : (size_t)self) + i) % pool.num_workers;
+            struct pool_worker *worker = &pool.workers[victim];
+            pthread_mutex_lock(&worker->lock);
+            struct pool_task *task = deque_take(&worker->queues[priority], (int)victim == self);
+            pthread_mutex_unlock(&worker->lock);
+            if (!task)
+                continue;
+            pthread_mutex_lock(&pool.lock);
+            pool.pending--;
+            if ((int)victim != self)
+                pool.steals++;
+            pthread_mutex_unlock(&pool.lock);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Runs a task and marks it done, waking the threads waiting for tasks to finish.
+ */
+static void run_task(struct pool_task *task)
+{
+    task->fn(task->arg);
+    pthread_mutex_lock(&pool.lock);
+    pool.completed++;
+    if (task->detached)
+        free(task);
+    else
+        task->done = true;
+    pthread_cond_broadcast(&pool.finished);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * A pool worker: runs tasks until the pool is emptied, then sleeps until more are submitted.
+ */
+static void *pool_worker(void *arg)
+{
+    current_worker = (int)(intptr_t)arg;
+    while (1)
+    {
+        struct pool_task *task = take_task(current_worker);
+        if (task)
+        {
+            run_task(task);
+            continue;
+        }
+        pthread_mutex_lock(&pool.lock);
+        while (pool.pending == 0)
+            pthread_cond_wait(&pool.work, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+/**
+ * fork() handlers: the pool is quiesced (every lock held, so no deque is half updated) across the
+ * fork, and the child starts without a pool, since its worker threads do not exist there. A child
+ * that submits work gets a fresh pool of its own.
+ */
+static void pool_prepare_fork(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    for (size_t i = 0; i < pool.num_workers; i++)
+        pthread_mutex_lock(&pool.workers[i].lock);
+}
+
+static void pool_parent_after_fork(void)
+{
+    for (size_t i = 0; i < pool.num_workers; i++)
+        pthread_mutex_unlock(&pool.workers[i].lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void pool_child_after_fork(void)
+{
+    // The parent's queued tasks and worker state are left behind; the child does not run them.
+    pool = (struct thread_pool){0};
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.finished, NULL);
+    current_worker = -1;
+}
+
+/**
+ * Starts the pool's workers on first use: one per CPU the shell may use, which is the smaller of its
+ * CPU affinity and its cgroup's CPU quota.
+ */
+static void start_pool(void)
+{
+    static bool fork_handlers = false;
+    if (!fork_handlers)
+    {
+        pthread_atfork(pool_prepare_fork, pool_parent_after_fork, pool_child_after_fork);
+        fork_handlers = true;
+    }
+    cpu_set_t cpus;
+    size_t size = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : 1;
+    size_t limit = cgroup_cpu_limit();
+    if (limit > 0 && limit < size)
+        size = limit;
+    if (size > POOL_MAX_WORKERS)
+        size = POOL_MAX_WORKERS;
+    if (size == 0)
+        size = 1;
+
+    struct pool_worker *workers = calloc(size, sizeof(struct pool_worker));
+    if (!workers)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < size; i++)
+        pthread_mutex_init(&workers[i].lock, NULL);
+    pthread_mutex_lock(&pool.lock);
+    pool.workers = workers;
+    pool.started = true;
+    // Block signals in the workers so that the shell's handlers always run on the main thread.
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    for (size_t i = 0; i < size; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, pool_worker, (void *)(intptr_t)i) != 0)
+            break;
+        pool.num_workers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * Queues a task on the shell-wide thread pool. Tasks submitted by a worker go to its own deque; others
+ * are spread over the workers. Idle workers steal from busy ones.
+ *
+ * @param fn The work.
+ * @param arg Passed to fn.
+ * @param priority 0 (most urgent) to POOL_PRIORITIES - 1 (background work); out of range values are
+ *                 clamped.
+ * @param detached The task frees itself when done and cannot be waited for.
+ * @return The task, to be passed to pool_wait() unless detached. If the pool cannot run threads the
+ *         task has already run.
+ */
+static struct pool_task *pool_submit(void (*fn)(void *arg), void *arg, int priority, bool detached)
+{
+    if (!pool.started)
+        start_pool();
+    struct pool_task *task = calloc(1, sizeof(struct pool_task));
+    if (!task)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    task->fn = fn;
+    task->arg = arg;
+    task->detached = detached;
+    if (pool.num_workers == 0)
+    {
+        fn(arg); // No threads could be started: run the task right away.
+        task->done = true;
+        if (detached)
+        {
+            free(task);
+            return NULL;
+        }
+        return task;
+    }
+    priority = priority < 0 ? 0 : priority >= POOL_PRIORITIES ? POOL_PRIORITIES - 1 : priority;
+    size_t target = current_worker >= 0 ? (size_t)current_worker : pool.next_worker++ % pool.num_workers;
+    pthread_mutex_lock(&pool.workers[target].lock);
+    deque_push(&pool.workers[target].queues[priority], task);
+    pthread_mutex_unlock(&pool.workers[target].lock);
+    pthread_mutex_lock(&pool.lock);
+    pool.pending++;
+    pool.submitted++;
+    pthread_cond_signal(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    return task;
+}
+
+/**
+ * Waits for a task to finish and frees it. While waiting the caller runs other queued tasks, so that
+ * tasks waiting on tasks cannot exhaust the pool.
+ *
+ * @param task A task returned by pool_submit() without detached.
+ */
+static void pool_wait(struct pool_task *task)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&pool.lock);
+        bool done = task->done;
+        pthread_mutex_unlock(&pool.lock);
+        if (done)
+            break;
+        struct pool_task *other = take_task(current_worker);
+        if (other)
+        {
+            run_task(other);
+            continue;
+        }
+        pthread_mutex_lock(&pool.lock);
+        if (!task->done)
+            pthread_cond_wait(&pool.finished, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    free(task);
+}
+
+/**
+ * pool_submit() and pool_wait() as offered to loadable builtins, whose tasks can always be waited for.
+ */
+static void *builtin_pool_submit(void (*fn)(void *arg), void *arg, int priority)
+{
+    return pool_submit(fn, arg, priority, false);
+}
+
+static void builtin_pool_wait(void *task)
+{
+    pool_wait(task);
+}
+
+/**
+ * Asks the kernel to read a file into the page cache ahead of use, followed by the shared libraries it
+ * needs, up to PREFETCH_DEPTH levels deep. Files warmed within the last PREFETCH_REWARM_SECS are
+ * skipped, since their pages are most likely still cached.
+ *
+ * @param path The executable or library.
+ * @param depth The current dependency depth.
+ */
+static void warm_file(const char *path, int depth)
+{
+    time_t now = time(NULL);
+    struct warmed_file *warmed = warmed_files;
+    while (warmed && strcmp(warmed->path, path) != 0)
+        warmed = warmed->next;
+    if (warmed && now - warmed->when < PREFETCH_REWARM_SECS)
+        return;
+    if (!warmed)
+    {
+        warmed = calloc(1, sizeof(struct warmed_file));
+        if (!warmed)
+            return;
+        warmed->path = strdup(path);
+        warmed->next = warmed_files;
+        warmed_files = warmed;
+    }
+    warmed->when = now;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED); // Starts asynchronous readahead of the whole file.
+    prefetched_files++;
+    if (depth < PREFETCH_DEPTH)
+    {
+        char *needed[64], *run_path;
+        size_t count = read_elf_needed(fd, needed, 64, &run_path);
+        char origin[PATH_MAX];
+        snprintf(origin, sizeof(origin), "%s", path);
+        char *slash = strrchr(origin, '/');
+        if (slash)
+            *slash = '\0';
+        for (size_t i = 0; i < count; i++)
+        {
+            char library[PATH_MAX];
+            if (find_library(needed[i], run_path, origin, library))
+                warm_file(library, depth + 1);
+            free(needed[i]);
+        }
+        free(run_path);
+    }
+    close(fd);
+}
+
+/**
+ * Thread pool task warming a predicted command and its libraries.
+ */
+static void prefetch_task(void *arg)
+{
+    pthread_mutex_lock(&prefetch_lock);
+    warm_file(arg, 0);
+    pthread_mutex_unlock(&prefetch_lock);
+    free(arg);
+}
+
+/**
+ * Prefetches the command the user is most likely to run next, so that its pages are in memory by the
+ * time it is executed. Called while the shell waits for input; the reading happens at the lowest
+ * priority on the thread pool, so the prompt is never held up.
+ */
+static void prefetch_next_command(void)
+{
+    const char *name = predict_command();
+    const char *path = name ? resolve_command(name) : NULL;
+    if (path)
+        pool_submit(prefetch_task, strdup(path), POOL_PRIORITIES - 1, true);
+}
+
+/**
+ * Looks up a builtin command by name.
+ *
+ * @param name The command name.
+ * @return The builtin, or NULL if name is not a builtin.
+ */
+static const struct builtin *find_builtin(const char *name)
+{
+    for (size_t i = 0; i < sizeof(builtin_table) / sizeof(builtin_table[0]); i++)
+    {
+        if (strcmp(builtin_table[i].name, name) == 0)
+            return &builtin_table[i];
+    }
+    for (struct loaded_builtin *loaded = loaded_builtins; loaded; loaded = loaded->next)
+    {
+        if (strcmp(loaded->builtin.name, name) == 0)
+            return &loaded->builtin;
+    }
+    return NULL;
+}
+
+/**
+ * Runs a builtin with the shell's current standard descriptors, which already carry its redirections.
+ *
+ * @return The builtin's exit status.
+ */
+static int call_builtin(const struct builtin *builtin, size_t argc, char *argv[])
+{
+    if (!builtin->loaded)
+        return builtin->fn(argc, argv);
+    struct shell_builtin_api api = {
+        .abi_version = SHELL_BUILTIN_ABI_VERSION,
+        .size = sizeof(struct shell_builtin_api),
+        .in_fd = STDIN_FILENO,
+        .out_fd = STDOUT_FILENO,
+        .err_fd = STDERR_FILENO,
+        .get_var = get_var,
+        .set_var = set_var,
+        .submit = builtin_pool_submit,
+        .wait = builtin_pool_wait,
+    };
+    return builtin->loaded->run(&api, (int)argc, argv);
+}
+
+/**
+ * Loads the builtin name from a shared object, which must export a struct shell_builtin called
+ * <name>_builtin built against this shell's SHELL_BUILTIN_ABI_VERSION.
+ *
+ * @return The exit status for enable.
+ */
+static int load_builtin(const char *path, const char *name)
+{
+    if (find_builtin(name))
+    {
+        fprintf(stderr, "enable: %s: already a builtin\n", name);
+        return 1;
+    }
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+    {
+        fprintf(stderr, "enable: %s\n", dlerror());
+        return 1;
+    }
+    char symbol[256];
+    snprintf(symbol, sizeof(symbol), "%s_builtin", name);
+    const struct shell_builtin *def = dlsym(handle, symbol);
+    const char *problem = NULL;
+    if (!def)
+        problem = "no such builtin in the library";
+    else if (def->abi_version != SHELL_BUILTIN_ABI_VERSION)
+        problem = "built for a different builtin ABI version";
+    else if (!def->run || !def->name || strcmp(def->name, name) != 0)
+        problem = "malformed builtin definition";
+    if (problem)
+    {
+        fprintf(stderr, "enable: %s: %s: %s\n", path, name, problem);
+        dlclose(handle);
+        return 1;
+    }
+
+    struct loaded_builtin *loaded = calloc(1, sizeof(struct loaded_builtin));
+    if (!loaded)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    loaded->builtin.name = def->name;
+    loaded->builtin.usage = def->usage ? def->usage : def->name;
+    loaded->builtin.loaded = def;
+    loaded->handle = handle;
+    loaded->path = strdup(path);
+    loaded->next = loaded_builtins;
+    loaded_builtins = loaded;
+    return 0;
+}
+
+/**
+ * Lists the loaded builtins, loads one from a shared object (-f lib.so name) or unloads one (-d name).
+ */
+static int builtin_enable(size_t argc, char *argv[])
+{
+    if (argc == 4 && strcmp(argv[1], "-f") == 0)
+        return load_builtin(argv[2], argv[3]);
+    if (argc == 3 && strcmp(argv[1], "-d") == 0)
+    {
+        for (struct loaded_builtin **link = &loaded_builtins; *link; link = &(*link)->next)
+        {
+            struct loaded_builtin *loaded = *link;
+            if (strcmp(loaded->builtin.name, argv[2]) != 0)
+                continue;
+            *link = loaded->next;
+            dlclose(loaded->handle);
+            free(loaded->path);
+            free(loaded);
+            return 0;
+        }
+        fprintf(stderr, "enable: %s: not a loaded builtin\n", argv[2]);
+        return 1;
+    }
+    if (argc != 1)
+    {
+        fprintf(stderr, "usage: enable [-f lib.so name | -d name]\n");
+        return 2;
+    }
+    for (struct loaded_builtin *loaded = loaded_builtins; loaded; loaded = loaded->next)
+        printf("enable -f %s %s\n", loaded->path, loaded->builtin.name);
+    return 0;
+}
+
+/**
+ * Opens the current directory as a directory stack entry.
+ *
+ * @return false if it could not be opened (an error has been printed).
+ */
+static bool open_cwd(struct dir_entry *entry, const char *cmd)
+{
+    entry->fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (entry->fd == -1)
+    {
+        fprintf(stderr, "%s: cannot open the current directory: %s\n", cmd, strerror(errno));
+        return false;
+    }
+    entry->path = getcwd(NULL, 0);
+    if (!entry->path)
+        entry->path = strdup(".");
+    return true;
+}
+
+static void close_dir_entry(struct dir_entry *entry)
+{
+    if (entry->fd != -1)
+        close(entry->fd);
+    free(entry->path);
+    entry->fd = -1;
+    entry->path = NULL;
+}
+
+/**
+ * Changes to the directory of an entry and replaces the entry with the directory just left, so that
+ * the same call switches back.
+ *
+ * @return false if the directory could not be entered (an error has been printed; nothing changed).
+ */
+static bool swap_dir(struct dir_entry *entry, const char *cmd)
+{
+    struct dir_entry here;
+    if (!open_cwd(&here, cmd))
+        return false;
+    if (fchdir(entry->fd) == -1)
+    {
+        fprintf(stderr, "%s: %s: %s\n", cmd, entry->path, strerror(errno));
+        close_dir_entry(&here);
+        return false;
+    }
+    close_dir_entry(entry);
+    *entry = here;
+    return true;
+}
+
+/**
+ * Changes to a directory named by a path, remembering the directory left for cd -.
+ *
+ * @return false if the directory could not be entered (an error has been printed).
+ */
+static bool change_dir(const char *path, const char *cmd)
+{
+    struct dir_entry here;
+    if (!open_cwd(&here, cmd))
+        return false;
+    if (chdir(path) == -1)
+    {
+        fprintf(stderr, "%s: %s: %s\n", cmd, path, strerror(errno));
+        close_dir_entry(&here);
+        return false;
+    }
+    close_dir_entry(&dir_stack.previous);
+    dir_stack.previous = here;
+    return true;
+}
+
+static void print_cwd(void)
+{
+    char *cwd = getcwd(NULL, 0);
+    printf("%s\n", cwd ? cwd : ".");
+    free(cwd);
+}
+
+/**
+ * Changes the current directory, or with 'cd -' returns to the previous one.
+ */
+static int builtin_cd(size_t argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "cd: missing operand\n");
+        return 1;
+    }
+    if (strcmp(argv[1], "-") != 0)
+        return change_dir(argv[1], "cd") ? 0 : 1;
+    if (dir_stack.previous.fd == -1)
+    {
+        fprintf(stderr, "cd: no previous directory\n");
+        return 1;
+    }
+    if (!swap_dir(&dir_stack.previous, "cd"))
+        return 1;
+    print_cwd();
+    return 0;
+}
+
+/**
+ * Parses the +n of pushd and popd, which counts entries as dirs lists them: 0 is the current
+ * directory, 1 the top of the stack.
+ *
+ * @return n, or -1 if arg is not of that form or there is no such entry (an error has been printed).
+ */
+static long dir_stack_index(const char *arg, const char *cmd)
+{
+    char *end;
+    long n = strtol(arg + 1, &end, 10);
+    if (arg[1] == '\0' || *end != '\0' || n < 0)
+    {
+        fprintf(stderr, "%s: %s: invalid argument\n", cmd, arg);
+        return -1;
+    }
+    if ((size_t)n > dir_stack.len)
+    {
+        fprintf(stderr, "%s: %s: directory stack index out of range\n", cmd, arg);
+        return -1;
+    }
+    return n;
+}
+
+static void list_dirs(bool numbered)
+{
+    char *cwd = getcwd(NULL, 0);
+    if (numbered)
+        printf(" 0  %s\n", cwd ? cwd : ".");
+    else
+        printf("%s", cwd ? cwd : ".");
+    free(cwd);
+    for (size_t i = 1; i <= dir_stack.len; i++)
+    {
+        const char *path = dir_stack.entries[dir_stack.len - i].path;
+        if (numbered)
+            printf("%2zu  %s\n", i, path);
+        else
+            printf(" %s", path);
+    }
+    if (!numbered)
+        printf("\n");
+}
+
+/**
+ * Saves the current directory on the directory stack and changes to dir; with no argument, swaps the
+ * current directory with the top of the stack; with +n, rotates the stack so that entry n becomes
+ * the current directory.
+ */
+static int builtin_pushd(size_t argc, char *argv[])
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "usage: pushd [dir | +n]\n");
+        return 2;
+    }
+    if (argc == 1)
+    {
+        if (dir_stack.len == 0)
+        {
+            fprintf(stderr, "pushd: no other directory\n");
+            return 1;
+        }
+        if (!swap_dir(&dir_stack.entries[dir_stack.len - 1], "pushd"))
+            return 1;
+        list_dirs(false);
+        return 0;
+    }
+    if (argv[1][0] == '+')
+    {
+        long n = dir_stack_index(argv[1], "pushd");
+        if (n == -1)
+            return 1;
+        if (n == 0)
+        {
+            list_dirs(false);
+            return 0;
+        }
+        // The list dirs shows is rotated left n times: entry n becomes the current directory, the
+        // entries above it move to the bottom of the stack and the old current directory joins them.
+        size_t len = dir_stack.len, top = n - 1; // Entries 1 to n-1, which move to the bottom.
+        struct dir_entry *rotated = malloc(len * sizeof(struct dir_entry));
+        if (!rotated)
+        {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        if (!swap_dir(&dir_stack.entries[len - n], "pushd"))
+        {
+            free(rotated);
+            return 1;
+        }
+        memcpy(rotated, dir_stack.entries + len - top, top * sizeof(struct dir_entry));
+        rotated[top] = dir_stack.entries[len - n];
+        memcpy(rotated + top + 1, dir_stack.entries, (len - n) * sizeof(struct dir_entry));
+        free(dir_stack.entries);
+        dir_stack.entries = rotated;
+        dir_stack.cap = len;
+        list_dirs(false);
+        return 0;
+    }
+    struct dir_entry here;
+    if (!open_cwd(&here, "pushd"))
+        return 1;
+    if (chdir(argv[1]) == -1)
+    {
+        fprintf(stderr, "pushd: %s: %s\n", argv[1], strerror(errno));
+        close_dir_entry(&here);
+        return 1;
+    }
+    if (dir_stack.len == dir_stack.cap)
+    {
+        dir_stack.cap = dir_stack.cap ? dir_stack.cap * 2 : 8;
+        dir_stack.entries = realloc(dir_stack.entries, dir_stack.cap * sizeof(struct dir_entry));
+        if (!dir_stack.entries)
+        {
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    dir_stack.entries[dir_stack.len++] = here;
+    list_dirs(false);
+    return 0;
+}
+
+/**
+ * Returns to the directory on top of the directory stack, removing it; with +n, removes entry n
+ * without changing directory.
+ */
+static int builtin_popd(size_t argc, char *argv[])
+{
+    if (argc > 2 || (argc == 2 && argv[1][0] != '+'))
+    {
+        fprintf(stderr, "usage: popd [+n]\n");
+        return 2;
+    }
+    if (dir_stack.len == 0)
+    {
+        fprintf(stderr, "popd: directory stack empty\n");
+        return 1;
+    }
+    long n = argc == 2 ? dir_stack_index(argv[1], "popd") : 0;
+    if (n == -1)
+        return 1;
+    if (n == 0)
+    {
+        // The directory left becomes the one cd - returns to.
+        if (!swap_dir(&dir_stack.entries[dir_stack.len - 1], "popd"))
+            return 1;
+        close_dir_entry(&dir_stack.previous);
+        dir_stack.previous = dir_stack.entries[--dir_stack.len];
+    }
+    else
+    {
+        close_dir_entry(&dir_stack.entries[dir_stack.len - n]);
+        memmove(dir_stack.entries + dir_stack.len - n, dir_stack.entries + dir_stack.len - n + 1,
+                (n - 1) * sizeof(struct dir_entry));
+        dir_stack.len--;
+    }
+    list_dirs(false);
+    return 0;
+}
+
+/**
+ * Lists the current directory and the directory stack, with -v one per line and numbered; -c clears
+ * the stack.
+ */
+static int builtin_dirs(size_t argc, char *argv[])
+{
+    bool numbered = false;
+    for (size_t i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0)
+        {
+            while (dir_stack.len > 0)
+                close_dir_entry(&dir_stack.entries[--dir_stack.len]);
+            return 0;
+        }
+        if (strcmp(argv[i], "-v") != 0)
+        {
+            fprintf(stderr, "usage: dirs [-c] [-v]\n");
+            return 2;
+        }
+        numbered = true;
+    }
+    list_dirs(numbered);
+    return 0;
+}
+
+/**
+ * Lists the shell options with 'set' or 'set -o', and enables or disables them with 'set -o name'
+ * and 'set +o name'.
+ */
+static int builtin_set(size_t argc, char *argv[])
+{
+    const size_t num_options = sizeof(option_table) / sizeof(option_table[0]);
+    if (argc == 1 || (argc == 2 && strcmp(argv[1], "-o") == 0))
+    {
+        for (size_t i = 0; i < num_options; i++)
+        {
+            printf("%-10s %-3s  %s\n", option_table[i].name, *option_table[i].flag ? "on" : "off",
+                   option_table[i].description);
+        }
+        return 0;
+    }
+    int ret = 0;
+    for (size_t i = 1; i < argc; i++)
+    {
+        bool enable = strcmp(argv[i], "-o") == 0;
+        if ((!enable && strcmp(argv[i], "+o") != 0) || i + 1 >= argc)
+        {
+            fprintf(stderr, "set: usage: set [-o|+o option]\n");
+            return 2;
+        }
+        const char *name = argv[++i];
+        size_t j = 0;
+        while (j < num_options && strcmp(option_table[j].name, name) != 0)
+            j++;
+        if (j == num_options)
+        {
+            fprintf(stderr, "set: %s: invalid option name\n", name);
+            ret = 1;
+            continue;
+        }
+        *option_table[j].flag = enable;
+        clear_parse_cache(); // Cached lines were parsed under the old options.
+    }
+    return ret;
+}
+
+/**
+ * Looks up an alias.
+ *
+ * @return The words the alias stands for, or NULL if there is no such alias.
+ */
+static const char *find_alias(const char *name)
+{
+    for (struct shell_var *alias = alias_table; alias; alias = alias->next)
+    {
+        if (strcmp(alias->name, name) == 0)
+            return alias->value;
+    }
+    return NULL;
+}
+
+/**
+ * Defines or redefines an alias.
+ */
+static void set_alias(const char *name, const char *value)
+{
+    clear_parse_cache(); // Cached lines may have been split with the old definition.
+    for (struct shell_var *alias = alias_table; alias; alias = alias->next)
+    {
+        if (strcmp(alias->name, name) == 0)
+        {
+            free(alias->value);
+            alias->value = strdup(value);
+            return;
+        }
+    }
+    struct shell_var *alias = malloc(sizeof(struct shell_var));
+    if (!alias)
+    {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    alias->name = strdup(name);
+    alias->value = strdup(value);
+    alias->next = alias_table;
+    alias_table = alias;
+}
+
+/**
+ * Lists the aliases with 'alias', shows one with 'alias name', and defines one with
+ * 'alias name=words...', where the rest of the line is what name stands for.
+ */
+static int builtin_alias(size_t argc, char *argv[])
+{
+    if (argc == 1)
+    {
+        for (struct shell_var *alias = alias_table; alias; alias = alias->next)
+            printf("alias %s=%s\n", alias->name, alias->value);
+        return 0;
+    }
+    size_t name_len = strcspn(argv[1], "=");
+    if (argv[1][name_len] == '\0')
+    {
+        const char *value = find_alias(argv[1]);
+        if (!value)
+        {
+            fprintf(stderr, "alias: %s: not found\n", argv[1]);
+            return 1;
+        }
+        printf("alias %s=%s\n", argv[1], value);
+        return 0;
+    }
+    if (name_len == 0 || argv[1][name_len + 1] == '\0')
+    {
+        fprintf(stderr, "usage: alias [name[=words...]]\n");
+        return 2;
+    }
+    char *name = strndup(argv[1], name_len);
+    struct strbuf value = {0};
+    strbuf_appendf(&value, "%s", argv[1] + name_len + 1);
+    for (size_t i = 2; i < argc; i++)
+        strbuf_appendf(&value, " %s", argv[i]);
+    set_alias(name, value.data);
+    free(name);
+    free(value.data);
+    return 0;
+}
+
+/**
+ * Removes the named aliases, or all of them with -a.
+ */
+static int builtin_unalias(size_t argc, char *argv[])
+{
+    if (argc == 1)
+    {
+        fprintf(stderr, "usage: unalias -a | name...\n");
+        return 2;
+    }
+    bool all = argc == 2 && strcmp(argv[1], "-a") == 0;
+    int ret = 0;
+    for (size_t i = 1; i < argc; i++)
+    {
+        struct shell_var **link = &alias_table;
+        bool found = false;
+        while (*link)
+        {
+            struct shell_var *alias = *link;
+            if (!all && strcmp(alias->name, argv[i]) != 0)
+            {
+                link = &alias->next;
+                continue;
+            }
+            *link = alias->next;
+            free(alias->name);
+            free(alias->value);
+            free(alias);
+            clear_parse_cache();
+            found = true;
+            if (!all)
+                break;
+        }
+        if (!found && !all)
+        {
+            fprintf(stderr, "unalias: %s: not found\n", argv[i]);
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+/**
+ * Whether a builtin only changes state that a startup snapshot restores (aliases, options and the
+ * working directory), so that an rc file running it can still be snapshotted.
+ */
+static bool snapshot_builtin(const struct builtin *builtin)
+{
+    return !builtin->loaded && (builtin->fn == builtin_cd || builtin->fn == builtin_set ||
+                                builtin->fn == builtin_alias || builtin->fn == builtin_unalias);
+}
+
+/**
+ * Runs a builtin inside the shell process, applying the stage's redirections around the call and
+ * restoring the shell's own standard input and output afterwards.
+ *
+ * @param builtin The builtin to run.
+ * @param stage The stage holding the arguments and redirections.
+ * @return The builtin's exit status.
+ */
+static int run_builtin(const struct builtin *builtin, struct stage *stage)
+{
+    int saved_in = -1, saved_out = -1, status = 1;
+    fflush(stdout);
+    if (stage->input_file)
+    {
+        saved_in = dup(STDIN_FILENO);
+        if (redirect_fd(stage->input_file, O_RDONLY, STDIN_FILENO) != 0)
+            goto restore;
+    }
+    if (stage->output_file)
+    {
+        saved_out = dup(STDOUT_FILENO);
+        if (redirect_fd(stage->output_file, O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO) != 0)
+            goto restore;
+    }
+    stats.spawns_shell++;
+    if (stage->input_file || stage->output_file || !snapshot_builtin(builtin))
+        unsnapshotted_builtins++;
+    status = call_builtin(builtin, stage->argc, stage->argv);
+    fflush(stdout);
+
+restore:
+    if (saved_in != -1)
+    {
+        dup2(saved_in, STDIN_FILENO);
+        close(saved_in);
+    }
+    if (saved_out != -1)
+    {
+        dup2(saved_out, STDOUT_FILENO);
+        close(saved_out);
+    }
+    return status;
+}
+
+/**
+ * @return The exit status of a stage whose program failed to execute with errno err.
+ */
+static int exec_failure_status(int err)
+{
+    return err == ENOENT ? 127 : 126;
+}
+
+/**
+ * Ends a forked stage that gave up before trying to exec (a redirection failed, say), telling the shell
+ * through the status pipe with an errno of 0 so that the closed pipe is not taken for a successful exec.
+ */
+static void exit_before_exec(int status_fd, int status)
+{
+    int err = 0;
+    if (status_fd != -1)
+        write(status_fd, &err, sizeof(err));
+    _exit(status);
+}
+
+/**
+ * Runs a stage in a freshly forked child: applies its redirections and executes the program. Builtins
+ * that are part of a pipeline run in the child as well, so they cannot affect the shell. Never returns.
+ *
+ * @param stage The stage to run.
+ * @param status_fd Write end of the stage's close-on-exec status pipe, which gets the errno of a failed
+ *                  exec, or -1. A program that cannot be found exits with 127, one that cannot be
+ *                  executed (not executable, say) with 126.
+ */
+static void exec_stage(struct stage *stage, int status_fd)
+{
+    if (stage->input_file && redirect_fd(stage->input_file, O_RDONLY, STDIN_FILENO) != 0)
+        exit_before_exec(status_fd, EXIT_FAILURE);
+    if (stage->output_file &&
+        redirect_fd(stage->output_file, O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO) != 0)
+        exit_before_exec(status_fd, EXIT_FAILURE);
+    if (stage->argc == 0)
+        _exit(0); // Only redirections, nothing to run.
+
+    const struct builtin *builtin = find_builtin(stage->argv[0]);
+    if (builtin)
+    {
+        int status = call_builtin(builtin, stage->argc, stage->argv);
+        fflush(stdout);
+        _exit(status);
+    }
+    if (stage->path)
+        execv(stage->path, stage->argv); // Falls through to a PATH search if the program moved.
+    execvp(stage->argv[0], stage->argv);
+    int err = errno;
+    if (status_fd != -1)
+        write(status_fd, &err, sizeof(err));
+    fprintf(stderr, "%s: %s\n", stage->argv[0], err == ENOENT ? "command not found" : strerror(err));
+    _exit(exec_failure_status(err));
+}
+
+/**
+ * Splits the arguments on pipe symbols into stage templates. Each stage gets its own copy of its
+ * words, with its '<' and '>' redirections removed from the argument vector, and no variable expanded
+ * yet: expand_stages makes the stages of each run from the templates.
+ *
+ * @param num_args Number of arguments in args.
+ * @param args Array of arguments.
+ * @param num_stages Set to the number of stages.
+ * @return The array of stage templates, or NULL on a syntax error (an error has been printed).
+ */
+static struct stage *parse_stages(size_t num_args, char *args[], size_t *num_stages)
+{
+    size_t count = 1;
+    for (size_t i = 0; i < num_args; i++)
+    {
+        if (strcmp(args[i], "|") == 0)
+            count++;
+    }
+    struct stage *stages = calloc(count, sizeof(struct stage));
+    if (!stages)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t start = 0;
+    for (size_t s = 0; s < count; s++)
+    {
+        int pipe_idx = find_pipe_idx(num_args - start, args + start);
+        size_t span = pipe_idx == -1 ? num_args - start : (size_t)pipe_idx;
+        size_t len = span;
+        if (len == 0)
+        {
+            fprintf(stderr, "Syntax error near unexpected token `|'\n");
+            *num_stages = s;
+            free_stages(stages, s);
+            return NULL;
+        }
+
+        // Strip the redirections from a copy of the raw words, then keep what is left.
+        char *words[len + 1];
+        memcpy(words, args + start, len * sizeof(char *));
+        words[len] = NULL;
+        struct stage *stage = &stages[s];
+        redirect_input(&len, words, &stage->input_file);
+        redirect_output(&len, words, &stage->output_file);
+        stage->argv = malloc((len + 1) * sizeof(char *));
+        if (!stage->argv)
+        {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < len; i++)
+        {
+            stage->argv[i] = strdup(words[i]);
+        }
+        stage->argv[len] = NULL;
+        stage->argc = len;
+        stage->pid = -1;
+        stage->pidfd = -1;
+        stage->exec_fd = -1;
+        start += span + 1; // Skip the stage and the pipe symbol after it.
+    }
+    *num_stages = count;
+    return stages;
+}
+
+/**
+ * Makes the stages of one run from stage templates, expanding the variables in every word and
+ * redirection target with their current values.
+ *
+ * @param templates The stage templates made by parse_stages.
+ * @param num_stages The number of stages.
+ * @return A newly allocated array of stages, not yet started.
+ */
+static struct stage *expand_stages(const struct stage *templates, size_t num_stages)
+{
+    stats.commands_parsed++;
+    struct stage *stages = calloc(num_stages, sizeof(struct stage));
+    if (!stages)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t s = 0; s < num_stages; s++)
+    {
+        const struct stage *from = &templates[s];
+        struct stage *to = &stages[s];
+        to->argv = malloc((from->argc + 1) * sizeof(char *));
+        if (!to->argv)
+        {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < from->argc; i++)
+            to->argv[i] = expand_word(from->argv[i]);
+        to->argv[from->argc] = NULL;
+        to->argc = from->argc;
+        to->input_file = from->input_file ? expand_word(from->input_file) : NULL;
+        to->output_file = from->output_file ? expand_word(from->output_file) : NULL;
+        to->pid = -1;
+        to->pidfd = -1;
+        to->exec_fd = -1;
+    }
+    return stages;
+}
+
+/**
+ * Splits the arguments on pipe symbols into stages, as parse_stages does, with their variables
+ * expanded.
+ *
+ * @param num_args Number of arguments in args.
+ * @param args Array of arguments.
+ * @param num_stages Set to the number of stages.
+ * @return The array of stages, or NULL on a syntax error (an error has been printed).
+ */
+static struct stage *build_stages(size_t num_args, char *args[], size_t *num_stages)
+{
+    struct stage *templates = parse_stages(num_args, args, num_stages);
+    if (!templates)
+        return NULL;
+    struct stage *stages = expand_stages(templates, *num_stages);
+    free_stages(templates, *num_stages);
+    return stages;
+}
+
+/**
+ * Releases the stages built by build_stages.
+ *
+ * @param stages The array of stages.
+ * @param num_stages The number of stages in the array.
+ */
+static void free_stages(struct stage *stages, size_t num_stages)
+{
+    for (size_t s = 0; s < num_stages; s++)
+    {
+        for (size_t i = 0; i < stages[s].argc; i++)
+        {
+            free(stages[s].argv[i]);
+        }
+        free(stages[s].argv);
+        free(stages[s].input_file);
+        free(stages[s].output_file);
+        free(stages[s].path);
+        if (stages[s].limiter)
+            free_rate_limiter(stages[s].limiter);
+        if (stages[s].exec_fd != -1)
+        {
+            ev_remove(stages[s].exec_fd);
+            close(stages[s].exec_fd);
+        }
+    }
+    free(stages);
+}
+
+/**
+ * Computes the overall status of a finished pipeline: the status of the last stage, or with pipefail
+ * the status of the rightmost stage that failed.
+ *
+ * @param stages The finished stages.
+ * @param num_stages The number of stages.
+ * @return The pipeline's exit status.
+ */
+static int pipeline_status(const struct stage *stages, size_t num_stages)
+{
+    int status = 0;
+    for (size_t i = 0; i < num_stages; i++)
+    {
+        if (!options.pipefail || stages[i].status != 0)
+            status = stages[i].status;
+    }
+    return status;
+}
+
+/**
+ * Stores the stage statuses of a finished pipeline in PIPESTATUS and its overall status in $?.
+ *
+ * @param stages The finished stages.
+ * @param num_stages The number of stages.
+ */
+static void record_pipeline_status(const struct stage *stages, size_t num_stages)
+{
+    int *statuses = realloc(pipe_status, num_stages * sizeof(int));
+    if (!statuses)
+    {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+    }
+    pipe_status = statuses;
+    num_pipe_status = num_stages;
+    for (size_t i = 0; i < num_stages; i++)
+    {
+        pipe_status[i] = stages[i].status;
+    }
+    last_status = pipeline_status(stages, num_stages);
+}
+
+/**
+ * Prints which stage of a pipeline failed and how, used by the pipediag option.
+ *
+ * @param job The job the stage belongs to.
+ * @param idx The index of the stage that finished with a non-zero status.
+ */
+static void report_stage_failure(const struct job *job, size_t idx)
+{
+    const struct stage *stage = &job->stages[idx];
+    char prefix[32] = "";
+    if (job->background)
+        snprintf(prefix, sizeof(prefix), "[%d] ", job->id);
+    if (stage->signal)
+    {
+        fprintf(stderr, "pipediag: %sstage %zu/%zu (%s) terminated by signal %d (%s)\n", prefix, idx + 1,
+                job->num_stages, stage->argv[0], stage->signal, strsignal(stage->signal));
+    }
+    else
+    {
+        fprintf(stderr, "pipediag: %sstage %zu/%zu (%s) exited with status %d\n", prefix, idx + 1,
+                job->num_stages, stage->argv[0], stage->status);
+    }
+}
+
+/**
+ * Iterates over all jobs: the foreground job, if any, followed by the job table.
+ *
+ * @param job The current job, or NULL to get the first one.
+ * @return The next job, or NULL after the last one.
+ */
+static struct job *next_job(const struct job *job)
+{
+    if (!job)
+        return foreground_job ? foreground_job : job_table;
+    return job == foreground_job ? job_table : job->next;
+}
+
+/**
+ * Counts a stage of a job as ended, noting the time once the last one has.
+ */
+static void stage_ended(struct job *job)
+{
+    if (--job->running == 0)
+        clock_gettime(CLOCK_MONOTONIC, &job->finished);
+}
+
+/**
+ * Reaps the stages that have finished and records their statuses in their jobs. Stages are collected
+ * as they finish, so a failing stage is reported as soon as it exits rather than when its whole
+ * pipeline is done. Only the shell's own stages are waited for, so that a program embedding the
+ * library keeps its other children to itself.
+ */
+static void reap_children(void)
+{
+    for (struct job *job = next_job(NULL); job; job = next_job(job))
+    {
+        for (size_t idx = 0; idx < job->num_stages; idx++)
+        {
+            struct stage *stage = &job->stages[idx];
+            if (stage->finished || stage->pid <= 0)
+                continue;
+            int status;
+            struct rusage usage = {0};
+            pid_t pid = wait4(stage->pid, &status, WNOHANG, &usage);
+            if (pid == 0)
+                continue;
+            if (pid == -1)
+            {
+                perror("wait4");
+                stage->status = EXIT_FAILURE;
+            }
+            else if (WIFSIGNALED(status))
+            {
+                stage->signal = WTERMSIG(status);
+                stage->status = 128 + stage->signal;
+            }
+            else
+            {
+                stage->status = WEXITSTATUS(status);
+            }
+            if (stage->cancel_status)
+            {
+                stage->status = stage->cancel_status; // Killed because an earlier stage could not exec.
+                stage->signal = 0;
+            }
+            stage->finished = true;
+            stage->usage = usage;
+            if (job->perf)
+                read_perf_counters(&job->perf[idx]);
+            if (stage->pidfd != -1)
+            {
+                close(stage->pidfd);
+                stage->pidfd = -1;
+            }
+            stage_ended(job);
+            if (options.pipediag && job->num_stages > 1 && stage->status != 0)
+                report_stage_failure(job, idx);
+        }
+    }
+}
+
+/**
+ * Registers a descriptor with the event loop.
+ *
+ * @param fd The descriptor to watch.
+ * @param events The poll(2) events to wait for.
+ * @param callback Called from ev_wait when the descriptor is ready.
+ * @param data Passed to the callback.
+ */
+static void ev_add(int fd, short events, void (*callback)(int fd, short revents, void *data), void *data)
+{
+    if (loop.num_sources == loop.capacity)
+    {
+        loop.capacity = loop.capacity ? loop.capacity * 2 : 8;
+        loop.sources = realloc(loop.sources, loop.capacity * sizeof(struct ev_source));
+        if (!loop.sources)
+        {
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    loop.sources[loop.num_sources++] = (struct ev_source){fd, events, callback, data};
+}
+
+/**
+ * Stops watching a descriptor. Safe to call from a callback.
+ *
+ * @param fd The descriptor registered with ev_add.
+ */
+static void ev_remove(int fd)
+{
+    for (size_t i = 0; i < loop.num_sources; i++)
+    {
+        if (loop.sources[i].fd == fd)
+        {
+            loop.sources[i] = loop.sources[--loop.num_sources];
+            return;
+        }
+    }
+}
+
+/**
+ * Runs one iteration of the event loop: waits up to timeout_ms for a registered descriptor to become
+ * ready or a running stage to finish (through the stages' pidfds), runs the callbacks of the ready
+ * descriptors and reaps finished stages.
+ *
+ * @param timeout_ms How long to wait, or -1 to wait until something happens.
+ */
+static void ev_wait(int timeout_ms)
+{
+    size_t running = 0;
+    for (struct job *job = next_job(NULL); job; job = next_job(job))
+        running += job->running;
+
+    struct pollfd fds[loop.num_sources + running];
+    nfds_t nfds = 0;
+    for (size_t i = 0; i < loop.num_sources; i++)
+        fds[nfds++] = (struct pollfd){.fd = loop.sources[i].fd, .events = loop.sources[i].events};
+    size_t num_sources = nfds;
+    for (struct job *job = next_job(NULL); job; job = next_job(job))
+    {
+        for (size_t i = 0; i < job->num_stages; i++)
+        {
+            if (job->stages[i].finished || job->stages[i].pid <= 0)
+                continue;
+            if (job->stages[i].pidfd != -1)
+                fds[nfds++] = (struct pollfd){.fd = job->stages[i].pidfd, .events = POLLIN};
+            else if (timeout_ms < 0 || timeout_ms > EV_FALLBACK_POLL_MS)
+                timeout_ms = EV_FALLBACK_POLL_MS;
+        }
+    }
+
+    int ready = poll(fds, nfds, timeout_ms);
+    loop.wakeups++;
+    if (terminate_signal)
+        exit(128 + terminate_signal); // Runs the atexit handlers, which flush the audit log.
+    if (ready == -1)
+    {
+        if (errno != EINTR)
+            perror("poll");
+        return;
+    }
+    for (size_t i = 0; i < num_sources; i++)
+    {
+        if (fds[i].revents == 0)
+            continue;
+        // Callbacks may add or remove sources, so look the descriptor up again.
+        for (size_t j = 0; j < loop.num_sources; j++)
+        {
+            if (loop.sources[j].fd == fds[i].fd)
+            {
+                loop.sources[j].callback(fds[i].fd, fds[i].revents, loop.sources[j].data);
+                break;
+            }
+        }
+    }
+    if (running > 0)
+        reap_children();
+}
+
+/**
+ * Runs the event loop for a given time, returning early once *stop becomes true.
+ *
+ * @param ms How long to run the loop.
+ * @param stop Checked after every iteration, may be NULL.
+ */
+static void ev_sleep(long ms, const bool *stop)
+{
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while (!stop || !*stop)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long left = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        if (left <= 0)
+            break;
+        ev_wait(left);
+    }
+}
+
+/**
+ * Creates a non-blocking, close-on-exec timerfd firing every interval_ms.
+ *
+ * @param interval_ms The period of the timer.
+ * @return The timer descriptor, or -1 on failure (an error has been printed).
+ */
+static int create_timer(long interval_ms)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("timerfd_create");
+        return -1;
+    }
+    struct timespec period = {interval_ms / 1000, (interval_ms % 1000) * 1000000};
+    struct itimerspec spec = {period, period};
+    timerfd_settime(fd, 0, &spec, NULL);
+    return fd;
+}
+
+/**
+ * Consumes the expirations of a timerfd so that it stops polling as ready.
+ *
+ * @param fd The timer descriptor.
+ */
+static void drain_timer(int fd)
+{
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+        perror("timerfd");
+}
+
+/**
+ * Reads the largest capacity an unprivileged process may give a pipe.
+ *
+ * @return The limit in bytes.
+ */
+static int max_pipe_size(void)
+{
+    static int max_size = 0;
+    if (max_size == 0)
+    {
+        FILE *file = fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (!file || fscanf(file, "%d", &max_size) != 1)
+            max_size = 1 << 20;
+        if (file)
+            fclose(file);
+    }
+    return max_size;
+}
+
+/**
+ * Returns the capacity PIPESIZE asks for the pipe after stage idx. PIPESIZE is a comma separated list
+ * of sizes, one per pipe of a pipeline, whose last entry also applies to any further pipes.
+ *
+ * @param idx The index of the pipe in its pipeline.
+ * @return The size in bytes, or 0 to keep the kernel's default.
+ */
+static long requested_pipe_size(size_t idx)
+{
+    const char *value = get_var("PIPESIZE");
+    if (!value || !*value)
+        return 0;
+    char *list = strdup(value), *save;
+    long size = 0;
+    size_t i = 0;
+    for (char *token = strtok_r(list, ",", &save); token && i <= idx; token = strtok_r(NULL, ",", &save), i++)
+    {
+        if (!parse_size(token, &size))
+        {
+            fprintf(stderr, "PIPESIZE: %s: invalid size\n", token);
+            size = 0;
+            break;
+        }
+    }
+    free(list);
+    return size;
+}
+
+/**
+ * Takes one adaptive pipe sizing sample of a job. A pipe that has been full for several samples in a
+ * row (its writer keeps blocking), or that keeps swinging between full and empty (its reader keeps
+ * blocking between bursts), has its capacity doubled with F_SETPIPE_SZ, as long as all pipes of the
+ * job together stay within PIPEBUDGET bytes.
+ *
+ * @param job The running job.
+ */
+static void adapt_pipes(struct job *job)
+{
+    long budget = ADAPT_DEFAULT_BUDGET;
+    const char *value = get_var("PIPEBUDGET");
+    if (value && !parse_size(value, &budget))
+        budget = ADAPT_DEFAULT_BUDGET;
+    long total = 0;
+    for (size_t i = 0; i + 1 < job->num_stages; i++)
+        total += job->edges[i].capacity;
+
+    for (size_t i = 0; i + 1 < job->num_stages; i++)
+    {
+        struct pipe_edge *edge = &job->edges[i];
+        int fd = open_pipe_edge(job, i);
+        int used;
+        if (fd == -1)
+            continue;
+        if (ioctl(fd, FIONREAD, &used) != 0)
+        {
+            close(fd);
+            continue;
+        }
+        bool full = used * 10 >= edge->capacity * 9;
+        bool empty = used == 0;
+        edge->full_streak = full ? edge->full_streak + 1 : 0;
+        if ((full && edge->was_empty) || (empty && edge->was_full))
+            edge->swings++;
+        edge->was_full = full;
+        edge->was_empty = empty;
+
+        long grown = (long)edge->capacity * 2;
+        if (!edge->fixed && (edge->full_streak >= 3 || edge->swings >= 4) && grown <= max_pipe_size() &&
+            total - edge->capacity + grown <= budget)
+        {
+            int size = fcntl(fd, F_SETPIPE_SZ, (int)grown);
+            if (size > 0)
+            {
+                total += size - edge->capacity;
+                edge->capacity = size;
+            }
+            else
+            {
+                edge->fixed = true; // Over the per-user pipe limit, leave this pipe alone.
+            }
+            edge->full_streak = 0;
+            edge->swings = 0;
+        }
+        close(fd);
+    }
+}
+
+/**
+ * Logs the pipe sizes a job finished with, in a form that can be pinned with PIPESIZE for later runs.
+ *
+ * @param job The finished job.
+ */
+static void report_pipe_sizes(const struct job *job)
+{
+    if (job->num_stages < 2)
+        return;
+    struct strbuf sizes = {0};
+    for (size_t i = 0; i + 1 < job->num_stages; i++)
+        strbuf_appendf(&sizes, i ? ",%d" : "%d", job->edges[i].capacity);
+    char prefix[32] = "";
+    if (job->background)
+        snprintf(prefix, sizeof(prefix), "[%d] ", job->id);
+    fflush(stdout);
+    fprintf(stderr, "adaptpipe: %sfinal pipe sizes %s (pin with PIPESIZE=%s)\n", prefix, sizes.data, sizes.data);
+    free(sizes.data);
+}
+
+/**
+ * Event loop callback of the adaptive pipe sizing timer: samples the pipes of every running job, and
+ * stops the timer once no jobs are left running.
+ */
+static void adapt_timer_tick(int fd, short revents, void *data)
+{
+    drain_timer(fd);
+    bool any_running = false;
+    for (struct job *job = next_job(NULL); job; job = next_job(job))
+    {
+        if (job->running == 0)
+            continue;
+        any_running = true;
+        if (options.adaptpipe)
+            adapt_pipes(job);
+    }
+    if (!any_running || !options.adaptpipe)
+    {
+        ev_remove(fd);
+        close(fd);
+        adapt_timer_fd = -1;
+    }
+}
+
+/**
+ * Starts sampling pipes every ADAPT_INTERVAL_MS from the event loop, unless that is already happening.
+ */
+static void start_adapt_timer(void)
+{
+    if (adapt_timer_fd != -1)
+        return;
+    adapt_timer_fd = create_timer(ADAPT_INTERVAL_MS);
+    if (adapt_timer_fd != -1)
+        ev_add(adapt_timer_fd, POLLIN, adapt_timer_tick, NULL);
+}
+
+/**
+ * Writes a whole buffer, retrying after partial writes and interrupted calls.
+ *
+ * @param fd The descriptor to write to.
+ * @param buf The bytes to write.
+ * @param len The number of bytes.
+ * @return false if writing failed.
+ */
+static bool write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * Blocks SIGPIPE in the calling thread, so that writing to a closed pipe fails with EPIPE even in a
+ * program embedding the shell that has not ignored the signal.
+ *
+ * @param old Receives the signal mask to give back to unblock_sigpipe().
+ * @return Whether a SIGPIPE was already pending, in which case unblock_sigpipe() leaves it alone.
+ */
+static bool block_sigpipe(sigset_t *old)
+{
+    sigset_t set, pending;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    sigpending(&pending);
+    pthread_sigmask(SIG_BLOCK, &set, old);
+    return sigismember(&pending, SIGPIPE);
+}
+
+/**
+ * Discards the SIGPIPE that writes since block_sigpipe() may have raised, then restores the signal mask.
+ *
+ * @param old The mask block_sigpipe() saved.
+ * @param was_pending What block_sigpipe() returned.
+ */
+static void unblock_sigpipe(const sigset_t *old, bool was_pending)
+{
+    if (!was_pending)
+    {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        struct timespec zero = {0, 0};
+        while (sigtimedwait(&set, NULL, &zero) == -1 && errno == EINTR)
+            ;
+    }
+    pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+/**
+ * Writes the complete lines buffered by a relay, each prefixed with the job tag if jobtag is set, in a
+ * single write() so that they cannot be split by output of other jobs.
+ *
+ * @param relay The relay to flush.
+ * @param all Also write a trailing partial line (terminated with a newline), used at EOF and when the
+ *            buffer reaches LINEBUF_MAX.
+ */
+static void flush_relay(struct output_relay *relay, bool all)
+{
+    struct strbuf *pending = &relay->pending;
+    char *end = pending->len ? memrchr(pending->data, '\n', pending->len) : NULL;
+    size_t len = end ? (size_t)(end - pending->data + 1) : 0;
+    if (all && pending->len > len)
+    {
+        strbuf_append(pending, "\n", 1);
+        len = pending->len;
+    }
+    if (len == 0)
+        return;
+
+    struct strbuf out = {0};
+    if (options.jobtag)
+    {
+        char tag[32];
+        int tag_len = snprintf(tag, sizeof(tag), "[%d] ", relay->job->id);
+        for (size_t start = 0; start < len;)
+        {
+            size_t line_len = (char *)memchr(pending->data + start, '\n', len - start) - (pending->data + start) + 1;
+            strbuf_append(&out, tag, tag_len);
+            strbuf_append(&out, pending->data + start, line_len);
+            start += line_len;
+        }
+    }
+    else
+    {
+        strbuf_append(&out, pending->data, len);
+    }
+    fflush(relay->target == STDOUT_FILENO ? stdout : stderr);
+    sigset_t mask;
+    bool sigpipe_pending = block_sigpipe(&mask);
+    write_all(relay->target, out.data, out.len);
+    unblock_sigpipe(&mask, sigpipe_pending);
+    free(out.data);
+    memmove(pending->data, pending->data + len, pending->len - len + 1);
+    pending->len -= len;
+}
+
+/**
+ * Event loop callback reading the output of a relayed job.
+ */
+static void relay_output(int fd, short revents, void *data)
+{
+    struct output_relay *relay = data;
+    char buf[16384];
+    size_t room = relay->target == -1 ? sizeof(buf) : LINEBUF_MAX - relay->pending.len;
+    ssize_t n = read(fd, buf, room < sizeof(buf) ? room : sizeof(buf));
+    if (n > 0 && relay->target == -1)
+    {
+        size_t keep = CAPTURE_MAX - relay->pending.len; // Past the limit output is drained but dropped.
+        relay->truncated |= (size_t)n > keep;
+        strbuf_append(&relay->pending, buf, (size_t)n < keep ? (size_t)n : keep);
+        return;
+    }
+    if (n > 0)
+    {
+        strbuf_append(&relay->pending, buf, n);
+        flush_relay(relay, relay->pending.len >= LINEBUF_MAX);
+        return;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (relay->target != -1)
+        flush_relay(relay, true); // EOF: every process of the job has closed the pipe.
+    ev_remove(fd);
+    close(fd);
+    relay->fd = -1;
+    relay->job->open_relays--;
+}
+
+/**
+ * Creates a relay for one output stream of a job.
+ *
+ * @param job The job.
+ * @param target The descriptor relayed lines are written to, or -1 to capture the output.
+ * @param write_end Receives the write end of the pipe, for the job's processes.
+ * @return The relay, or NULL if the pipe could not be created.
+ */
+static struct output_relay *create_relay(struct job *job, int target, int *write_end)
+{
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == -1)
+    {
+        perror("pipe");
+        return NULL;
+    }
+    struct output_relay *relay = calloc(1, sizeof(struct output_relay));
+    if (!relay)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(fd[0], F_SETFL, O_NONBLOCK);
+    relay->fd = fd[0];
+    relay->target = target;
+    relay->job = job;
+    *write_end = fd[1];
+    ev_add(relay->fd, POLLIN, relay_output, relay);
+    job->open_relays++;
+    return relay;
+}
+
+/**
+ * Adds the tokens earned since the last refill, up to the bucket size.
+ *
+ * @param limiter The rate limiter.
+ */
+static void refill_tokens(struct rate_limiter *limiter)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - limiter->refilled.tv_sec) + (now.tv_nsec - limiter->refilled.tv_nsec) / 1e9;
+    limiter->refilled = now;
+    limiter->tokens += elapsed * limiter->rate;
+    if (limiter->tokens > limiter->quantum * RATELIMIT_BURST)
+        limiter->tokens = limiter->quantum * RATELIMIT_BURST;
+}
+
+/**
+ * Changes the events the event loop watches on one of a rate limiter's descriptors.
+ *
+ * @param limiter The rate limiter.
+ * @param fd in_fd or out_fd.
+ * @param current The events watched now, updated.
+ * @param events The events to watch, 0 for none.
+ */
+static void watch_fd(struct rate_limiter *limiter, int fd, short *current, short events)
+{
+    if (*current == events)
+        return;
+    if (*current)
+        ev_remove(fd);
+    if (events)
+        ev_add(fd, events, rate_limiter_event, limiter);
+    *current = events;
+}
+
+/**
+ * Finishes a rate limiter: closes its descriptors, which lets the neighbouring stages see EOF or
+ * SIGPIPE, and marks its stage as finished.
+ *
+ * @param limiter The rate limiter.
+ * @param status The stage's exit status.
+ */
+static void finish_rate_limiter(struct rate_limiter *limiter, int status)
+{
+    watch_fd(limiter, limiter->in_fd, &limiter->in_events, 0);
+    watch_fd(limiter, limiter->out_fd, &limiter->out_events, 0);
+    if (limiter->timer_fd != -1)
+    {
+        ev_remove(limiter->timer_fd);
+        close(limiter->timer_fd);
+        limiter->timer_fd = -1;
+    }
+    // The descriptors may share their open file description with the shell's standard input or output,
+    // which must not stay non-blocking for the shell and the programs it runs later.
+    if (limiter->in_flags != -1)
+        fcntl(limiter->in_fd, F_SETFL, limiter->in_flags);
+    if (limiter->out_flags != -1)
+        fcntl(limiter->out_fd, F_SETFL, limiter->out_flags);
+    close(limiter->in_fd);
+    close(limiter->out_fd);
+    limiter->done = true;
+    limiter->status = status;
+    if (limiter->stage)
+    {
+        limiter->stage->status = status;
+        limiter->stage->finished = true;
+        stage_ended(limiter->job);
+    }
+}
+
+/**
+ * Moves as much data as the available tokens allow, then decides what to wait for next: input, room
+ * in the output, or (with the bucket empty) the timer that fires once a quantum of tokens is earned.
+ *
+ * @param limiter The rate limiter.
+ */
+static void pump_rate_limiter(struct rate_limiter *limiter)
+{
+    refill_tokens(limiter);
+    bool blocked_out = false, blocked_in = false;
+    sigset_t mask;
+    bool sigpipe_pending = block_sigpipe(&mask);
+    while (!limiter->done && limiter->tokens >= 1)
+    {
+        size_t want = limiter->tokens < RATELIMIT_BUF ? (size_t)limiter->tokens : RATELIMIT_BUF;
+        if (limiter->use_splice && limiter->buf.len == 0)
+        {
+            ssize_t n = splice(limiter->in_fd, NULL, limiter->out_fd, NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+            {
+                limiter->tokens -= n;
+                continue;
+            }
+            if (n == 0)
+            {
+                finish_rate_limiter(limiter, 0);
+                break;
+            }
+            if (errno == EINVAL)
+            {
+                limiter->use_splice = false; // Neither side supports splicing here, copy instead.
+                continue;
+            }
+            if (errno == EPIPE)
+            {
+                finish_rate_limiter(limiter, 128 + SIGPIPE);
+                break;
+            }
+            if (errno != EAGAIN)
+            {
+                perror("ratelimit: splice");
+                finish_rate_limiter(limiter, 1);
+                break;
+            }
+            // Either side may be the one that is not ready; wait for both.
+            blocked_in = blocked_out = true;
+            break;
+        }
+
+        // Copy through the buffer: bytes up to the tokens, or only whole lines in line mode.
+        size_t len = limiter->buf.len;
+        if (limiter->lines)
+        {
+            char *newline = len ? memchr(limiter->buf.data, '\n', len) : NULL;
+            if (newline)
+                len = newline - limiter->buf.data + 1;
+            else if (!limiter->eof && len < RATELIMIT_BUF)
+                len = 0; // Wait for the rest of the line.
+        }
+        else if (len > want)
+        {
+            len = want;
+        }
+        if (len > 0)
+        {
+            ssize_t n = write(limiter->out_fd, limiter->buf.data, len);
+            if (n == -1 && errno == EAGAIN)
+            {
+                blocked_out = true;
+                break;
+            }
+            if (n == -1)
+            {
+                if (errno != EPIPE)
+                    perror("ratelimit: write");
+                finish_rate_limiter(limiter, errno == EPIPE ? 128 + SIGPIPE : 1);
+                break;
+            }
+            memmove(limiter->buf.data, limiter->buf.data + n, limiter->buf.len - n + 1);
+            limiter->buf.len -= n;
+            if (!limiter->lines)
+                limiter->tokens -= n;
+            else if ((size_t)n == len)
+                limiter->tokens -= 1;
+            continue;
+        }
+        if (limiter->eof)
+        {
+            finish_rate_limiter(limiter, 0);
+            break;
+        }
+        char chunk[RATELIMIT_BUF];
+        size_t room = RATELIMIT_BUF - limiter->buf.len;
+        ssize_t n = read(limiter->in_fd, chunk, limiter->lines ? room : (want < room ? want : room));
+        if (n > 0)
+            strbuf_append(&limiter->buf, chunk, n);
+        else if (n == 0)
+            limiter->eof = true;
+        else if (errno == EAGAIN)
+        {
+            blocked_in = true;
+            break;
+        }
+        else if (errno != EINTR)
+        {
+            perror("ratelimit: read");
+            finish_rate_limiter(limiter, 1);
+        }
+    }
+    unblock_sigpipe(&mask, sigpipe_pending);
+    if (limiter->done)
+        return;
+
+    bool starved = limiter->tokens < 1;
+    watch_fd(limiter, limiter->in_fd, &limiter->in_events, !starved && blocked_in ? POLLIN : 0);
+    watch_fd(limiter, limiter->out_fd, &limiter->out_events, !starved && blocked_out ? POLLOUT : 0);
+    if (starved)
+    {
+        // Sleep until a quantum of tokens has been earned.
+        double wait = (limiter->quantum - limiter->tokens) / limiter->rate;
+        struct itimerspec spec = {{0, 0}, {(time_t)wait, (long)((wait - (time_t)wait) * 1e9) + 1}};
+        timerfd_settime(limiter->timer_fd, 0, &spec, NULL);
+    }
+}
+
+/**
+ * Event loop callback for all of a rate limiter's descriptors.
+ */
+static void rate_limiter_event(int fd, short revents, void *data)
+{
+    struct rate_limiter *limiter = data;
+    if (fd == limiter->timer_fd)
+        drain_timer(fd);
+    pump_rate_limiter(limiter);
+}
+
+/**
+ * Parses 'ratelimit [-l] rate' and creates a rate limiter between two descriptors, which it takes over.
+ * Descriptors that are pipes are made non-blocking until the limiter is done, when their flags are
+ * restored; the limiter starts moving data from the event loop.
+ *
+ * @param argc Number of arguments.
+ * @param argv The ratelimit command.
+ * @param in_fd The descriptor to read from.
+ * @param out_fd The descriptor to write to.
+ * @return The limiter, or NULL if the arguments are invalid or its timer could not be created (an
+ *         error has been printed and the descriptors have been closed).
+ */
+static struct rate_limiter *create_rate_limiter(size_t argc, char *argv[], int in_fd, int out_fd)
+{
+    bool lines = argc == 3 && strcmp(argv[1], "-l") == 0;
+    long rate = 0;
+    if (argc != 2 + lines || !parse_size(argv[1 + lines], &rate) || rate <= 0)
+    {
+        fprintf(stderr, "ratelimit: usage: ratelimit [-l] rate[K|M|G]\n");
+        close(in_fd);
+        close(out_fd);
+        return NULL;
+    }
+    // Without its refill timer a limiter that ran out of tokens would wait forever.
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1)
+    {
+        perror("ratelimit: timerfd_create");
+        close(in_fd);
+        close(out_fd);
+        return NULL;
+    }
+    struct rate_limiter *limiter = calloc(1, sizeof(struct rate_limiter));
+    if (!limiter)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    limiter->in_fd = in_fd;
+    limiter->out_fd = out_fd;
+    limiter->lines = lines;
+    limiter->rate = rate;
+    limiter->quantum = rate * RATELIMIT_QUANTUM_MS / 1000.0;
+    if (limiter->quantum < 1)
+        limiter->quantum = 1;
+    limiter->tokens = limiter->quantum;
+    clock_gettime(CLOCK_MONOTONIC, &limiter->refilled);
+
+    struct stat in_st, out_st;
+    bool in_pipe = fstat(in_fd, &in_st) == 0 && S_ISFIFO(in_st.st_mode);
+    bool out_pipe = fstat(out_fd, &out_st) == 0 && S_ISFIFO(out_st.st_mode);
+    limiter->use_splice = !lines && (in_pipe || out_pipe);
+    limiter->in_flags = limiter->out_flags = -1;
+    for (int i = 0; i < 2; i++)
+    {
+        // Only pipes are switched to non-blocking, since a poll() on a terminal or file says nothing.
+        // A pipe may still be the shell's own standard input or output, hence the saved flags.
+        int fd = i ? out_fd : in_fd;
+        int flags = fcntl(fd, F_GETFL);
+        if ((i ? out_pipe : in_pipe) && flags != -1 && !(flags & O_NONBLOCK))
+        {
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+            *(i ? &limiter->out_flags : &limiter->in_flags) = flags;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC); // Keep stages forked later from holding the pipes open.
+    }
+    limiter->timer_fd = timer_fd;
+    ev_add(limiter->timer_fd, POLLIN, rate_limiter_event, limiter);
+    watch_fd(limiter, in_fd, &limiter->in_events, POLLIN);
+    return limiter;
+}
+
+/**
+ * Releases a rate limiter.
+ *
+ * @param limiter The limiter, which must be done.
+ */
+static void free_rate_limiter(struct rate_limiter *limiter)
+{
+    free(limiter->buf.data);
+    free(limiter);
+}
+
+/**
+ * Limits the rate at which standard input is copied to standard output, when ratelimit is run as a
+ * command of its own. In a pipeline it runs as an in-shell stage instead (see execute_pipe).
+ */
+static int builtin_ratelimit(size_t argc, char *argv[])
+{
+    struct rate_limiter *limiter = create_rate_limiter(argc, argv, dup(STDIN_FILENO), dup(STDOUT_FILENO));
+    if (!limiter)
+        return 2;
+    while (!limiter->done)
+        ev_wait(-1);
+    int status = limiter->status;
+    free_rate_limiter(limiter);
+    return status;
+}
+
+/**
+ * Checks whether a job still has running stages or output that has not been relayed yet.
+ *
+ * @param job The job.
+ * @return true until the job is completely finished.
+ */
+static bool job_active(const struct job *job)
+{
+    return job->running > 0 || job->open_relays > 0;
+}
+
+/**
+ * Waits until every started stage of a job has finished and its output has been relayed, running the
+ * event loop meanwhile.
+ *
+ * @param job The job to wait for.
+ */
+static void wait_job(struct job *job)
+{
+    while (job_active(job))
+    {
+        ev_wait(-1);
+    }
+}
+
+/**
+ * Releases a job and its stages.
+ *
+ * @param job The job to free.
+ */
+static void free_job(struct job *job)
+{
+    free_stages(job->stages, job->num_stages);
+    for (size_t i = 0; i < 2; i++)
+    {
+        if (!job->relays[i])
+            continue;
+        if (job->relays[i]->fd != -1)
+        {
+            ev_remove(job->relays[i]->fd);
+            close(job->relays[i]->fd);
+        }
+        free(job->relays[i]->pending.data);
+        free(job->relays[i]);
+    }
+    if (job->request)
+        free_request(job->request);
+    for (size_t idx = 0; job->perf && idx < job->num_stages; idx++)
+        read_perf_counters(&job->perf[idx]); // Closes the counters of stages that were never reaped.
+    free(job->perf);
+    free(job->edges);
+    free(job->cwd);
+    free(job->cmdline);
+    free(job);
+}
+
+/**
+ * Adds a background job to the job table, numbering it with the smallest unused job number.
+ *
+ * @param job The job to add.
+ */
+static void add_job(struct job *job)
+{
+    struct job **link = &job_table;
+    job->id = 1;
+    while (*link && (*link)->id == job->id)
+    {
+        job->id++;
+        link = &(*link)->next;
+    }
+    job->next = *link;
+    *link = job;
+}
+
+/**
+ * Looks up a background job from a '%n' or 'n' job specification.
+ *
+ * @param spec The job specification.
+ * @return The job, or NULL if there is no such job (an error has been printed).
+ */
+static struct job *find_job(const char *spec)
+{
+    char *end;
+    long id = strtol(spec + (spec[0] == '%'), &end, 10);
+    for (struct job *job = job_table; job && *end == '\0'; job = job->next)
+    {
+        if (job->id == id)
+            return job;
+    }
+    fprintf(stderr, "%s: no such job\n", spec);
+    return NULL;
+}
+
+/**
+ * Hands jobs with an on_finish callback (machine-mode requests and library runs) to their callback
+ * once they have finished, and removes them from the job table.
+ */
+static void finish_detached_jobs(void)
+{
+    struct job **link = &job_table;
+    while (*link)
+    {
+        struct job *job = *link;
+        if (!job->on_finish || job_active(job))
+        {
+            link = &job->next;
+            continue;
+        }
+        *link = job->next;
+        int status = pipeline_status(job->stages, job->num_stages);
+        finish_command(job->cmdline, job->stages, job->num_stages, job->cwd, job->submitted, job->started,
+                       job->finished, status);
+        job->on_finish(job, status, job->finish_data);
+        free_job(job);
+    }
+}
+
+/**
+ * Reports background jobs that have finished since the last prompt and removes them from the job table.
+ */
+static void notify_jobs(void)
+{
+    reap_children();
+    struct job **link = &job_table;
+    while (*link)
+    {
+        struct job *job = *link;
+        if (job->on_finish || job_active(job))
+        {
+            link = &job->next;
+            continue;
+        }
+        int status = pipeline_status(job->stages, job->num_stages);
+        if (status == 0)
+            printf("[%d]  Done       %s\n", job->id, job->cmdline);
+        else
+            printf("[%d]  Exit %-5d %s\n", job->id, status, job->cmdline);
+        if (options.adaptpipe)
+            report_pipe_sizes(job);
+        if (job->perf)
+            report_perf_counters(job);
+        finish_command(job->cmdline, job->stages, job->num_stages, job->cwd, job->submitted, job->started,
+                       job->finished, status);
+        *link = job->next;
+        free_job(job);
+    }
+}
+
+/**
+ * Lists the background jobs and whether they are still running.
+ */
+static int builtin_jobs(size_t argc, char *argv[])
+{
+    reap_children();
+    for (struct job *job = job_table; job; job = job->next)
+    {
+        if (job->on_finish)
+            continue;
+        if (job_active(job))
+            printf("[%d]  Running    %s\n", job->id, job->cmdline);
+        else
+            printf("[%d]  Done       %s\n", job->id, job->cmdline);
+    }
+    return 0;
+}
+
+/**
+ * Waits for the given background job, or for all of them, and returns the status of the last one
+ * waited for. Finished jobs are reported at the next prompt as usual.
+ */
+static int builtin_wait(size_t argc, char *argv[])
+{
+    int status = 0;
+    if (argc > 1)
+    {
+        for (size_t i = 1; i < argc; i++)
+        {
+            struct job *job = find_job(argv[i]);
+            if (!job)
+            {
+                status = 127;
+                continue;
+            }
+            wait_job(job);
+            status = pipeline_status(job->stages, job->num_stages);
+        }
+        return status;
+    }
+    for (struct job *job = job_table; job; job = job->next)
+    {
+        wait_job(job);
+        status = pipeline_status(job->stages, job->num_stages);
+    }
+    return status;
+}
+
+/**
+ * Reads a process's state letter, consumed CPU time (user + system, in clock ticks) and resident set
+ * size from /proc/PID/stat.
+ *
+ * @param pid The process to inspect.
+ * @param sample Receives the state, ticks and rss_pages fields.
+ * @return false if the process no longer exists.
+ */
+static bool read_proc_stat(pid_t pid, struct proc_sample *sample)
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return false;
+    buf[n] = '\0';
+
+    // The command name may contain spaces and parentheses, so parse from the last ')'.
+    char *fields = strrchr(buf, ')');
+    unsigned long long utime, stime;
+    if (!fields || sscanf(fields + 2,
+                          "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+                          &sample->state, &utime, &stime, &sample->rss_pages) != 4)
+        return false;
+    sample->ticks = utime + stime;
+    return true;
+}
+
+/**
+ * Reads the number of bytes a process has read and written, pipes and terminals included, from
+ * /proc/PID/io.
+ *
+ * @param pid The process to inspect.
+ * @param sample Receives the rchar and wchar fields.
+ * @return false if the counters are not available.
+ */
+static bool read_proc_io(pid_t pid, struct proc_sample *sample)
+{
+    char path[64], buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return false;
+    buf[n] = '\0';
+    return sscanf(buf, "rchar: %llu wchar: %llu", &sample->rchar, &sample->wchar) == 2;
+}
+
+/**
+ * Opens the pipe between stage idx and stage idx + 1 of a job. The pipe is reopened through
+ * /proc/PID/fd of one of the two stages, because the shell must not keep pipe ends open itself: that
+ * would change when the stages see EOF or SIGPIPE.
+ *
+ * @param job The job owning the pipe.
+ * @param idx The index of the writing stage.
+ * @return A new descriptor for the pipe, or -1 if neither stage is running or the edge is not a pipe.
+ */
+static int open_pipe_edge(const struct job *job, size_t idx)
+{
+    const struct stage *ends[] = {&job->stages[idx + 1], &job->stages[idx]};
+    const int fds[] = {STDIN_FILENO, STDOUT_FILENO};
+    for (size_t i = 0; i < 2; i++)
+    {
+        if (ends[i]->pid <= 0 || ends[i]->finished)
+            continue;
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)ends[i]->pid, fds[i]);
+        int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1)
+            continue;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+            return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+/**
+ * Measures how full the pipe between stage idx and stage idx + 1 of a job is.
+ *
+ * @param job The job owning the pipe.
+ * @param idx The index of the writing stage.
+ * @param used Set to the number of unread bytes in the pipe.
+ * @param capacity Set to the pipe's capacity in bytes.
+ * @return false if the pipe could not be reached.
+ */
+static bool read_pipe_fill(const struct job *job, size_t idx, int *used, int *capacity)
+{
+    int fd = open_pipe_edge(job, idx);
+    if (fd == -1)
+        return false;
+    bool ok = ioctl(fd, FIONREAD, used) == 0 && (*capacity = fcntl(fd, F_GETPIPE_SZ)) > 0;
+    close(fd);
+    return ok;
+}
+
+/**
+ * Prints one pipestat sample for a job: every stage with its CPU usage over the sampling interval, and
+ * between stages the fill level of the pipe connecting them. A stage whose input pipe is (nearly) full
+ * while its output pipe is not cannot keep up with its producer, so it is marked as the bottleneck.
+ *
+ * @param job The job to display.
+ * @param before CPU ticks of each stage at the start of the interval.
+ * @param interval_ms The length of the sampling interval.
+ */
+static void print_pipestat(const struct job *job, const unsigned long long before[], long interval_ms)
+{
+    size_t n = job->num_stages;
+    int used[n], capacity[n];
+    bool full[n];
+    for (size_t i = 0; i + 1 < n; i++)
+    {
+        full[i] = false;
+        if (read_pipe_fill(job, i, &used[i], &capacity[i]))
+            full[i] = used[i] * 10 >= capacity[i] * 9;
+        else
+            capacity[i] = 0;
+    }
+
+    printf("[%d] %s\n", job->id, job->cmdline);
+    printf("  %-3s %-8s %6s  %-2s %s\n", "#", "pid", "cpu%", "st", "command");
+    double ticks_per_ms = sysconf(_SC_CLK_TCK) / 1000.0;
+    for (size_t i = 0; i < n; i++)
+    {
+        const struct stage *stage = &job->stages[i];
+        struct proc_sample now;
+        if (stage->pid == 0 && !stage->finished)
+        {
+            printf("  %-3zu %-8s %6s  %-2s %s\n", i + 1, "shell", "-", "-", stage->argv[0]);
+        }
+        else if (stage->finished || !read_proc_stat(stage->pid, &now))
+        {
+            printf("  %-3zu %-8d %6s  %-2s %s (exited %d)\n", i + 1, (int)stage->pid, "-", "-", stage->argv[0],
+                   stage->status);
+        }
+        else
+        {
+            double cpu = (now.ticks - before[i]) / (ticks_per_ms * interval_ms) * 100.0;
+            bool bottleneck = i > 0 && full[i - 1] && (i + 1 == n || !full[i]);
+            printf("  %-3zu %-8d %6.1f  %-2c %s%s\n", i + 1, (int)stage->pid, cpu, now.state, stage->argv[0],
+                   bottleneck ? "   <- bottleneck" : "");
+        }
+        if (i + 1 == n)
+            break;
+        if (capacity[i] > 0)
+            printf("      | pipe %d/%d bytes (%d%%)%s\n", used[i], capacity[i], used[i] * 100 / capacity[i],
+                   full[i] ? " full" : "");
+        else
+            printf("      | pipe closed\n");
+    }
+}
+
+/**
+ * Parses the -i (interval in milliseconds) and -n (number of samples) options shared by pipestat and
+ * jobtop.
+ *
+ * @param cmd The builtin's name, for error messages.
+ * @param opt The option, "-i" or "-n".
+ * @param value The option's argument.
+ * @param interval_ms Set by -i.
+ * @param count Set by -n.
+ * @return false if the value is not valid (an error has been printed).
+ */
+static bool parse_sampling_option(const char *cmd, const char *opt, const char *value, long *interval_ms, long *count)
+{
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (*end != '\0' || end == value || number < 0 || (opt[1] == 'i' && number == 0))
+    {
+        fprintf(stderr, "%s: %s: invalid number\n", cmd, value);
+        return false;
+    }
+    *(opt[1] == 'i' ? interval_ms : count) = number;
+    return true;
+}
+
+/**
+ * Periodically samples the running background jobs: pipe occupancy via FIONREAD and per-stage CPU from
+ * /proc/PID/stat. With -n 0 sampling continues until the jobs finish.
+ */
+static int builtin_pipestat(size_t argc, char *argv[])
+{
+    long interval_ms = 1000, count = 1;
+    struct job *only = NULL;
+    for (size_t i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "-n") == 0) && i + 1 < argc)
+        {
+            if (!parse_sampling_option("pipestat", argv[i], argv[i + 1], &interval_ms, &count))
+                return 2;
+            i++;
+        }
+        else if (argv[i][0] != '-' && !only)
+        {
+            if (!(only = find_job(argv[i])))
+                return 1;
+        }
+        else
+        {
+            fprintf(stderr, "pipestat: usage: pipestat [-i ms] [-n count] [%%job]\n");
+            return 2;
+        }
+    }
+
+    for (long sample = 0; count == 0 || sample < count; sample++)
+    {
+        // Remember the CPU time of every stage, sleep for the interval, then report the difference.
+        size_t num_jobs = 0;
+        for (struct job *job = job_table; job; job = job->next)
+        {
+            if (job->running > 0 && (!only || job == only))
+                num_jobs++;
+        }
+        if (num_jobs == 0)
+        {
+            if (sample == 0)
+                printf("pipestat: no running jobs\n");
+            break;
+        }
+        struct job *jobs[num_jobs];
+        unsigned long long *before[num_jobs];
+        size_t j = 0;
+        for (struct job *job = job_table; job; job = job->next)
+        {
+            if (job->running == 0 || (only && job != only))
+                continue;
+            jobs[j] = job;
+            before[j] = calloc(job->num_stages, sizeof(unsigned long long));
+            if (!before[j])
+            {
+                perror("calloc failed");
+                exit(EXIT_FAILURE);
+            }
+            for (size_t i = 0; i < job->num_stages; i++)
+            {
+                struct proc_sample sample;
+                if (!job->stages[i].finished && read_proc_stat(job->stages[i].pid, &sample))
+                    before[j][i] = sample.ticks;
+            }
+            j++;
+        }
+        ev_sleep(interval_ms, NULL);
+        // Report the jobs sampled above, each with its own ticks. One that finished meanwhile shows its
+        // stages as exited, unless it has already left the job table.
+        for (j = 0; j < num_jobs; j++)
+        {
+            struct job *job = job_table;
+            while (job && job != jobs[j])
+                job = job->next;
+            if (job)
+                print_pipestat(job, before[j], interval_ms);
+            free(before[j]);
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
+
+/**
+ * Formats a byte count with a binary unit suffix, e.g. 1.5M.
+ *
+ * @param bytes The number of bytes.
+ * @param buf Receives the text.
+ * @param size The size of buf.
+ */
+static void format_size(double bytes, char *buf, size_t size)
+{
+    const char units[] = "BKMGT";
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4)
+    {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(buf, size, unit ? "%.1f%c" : "%.0f%c", bytes, units[unit]);
+}
+
+/**
+ * Draws one jobtop frame: every background job with its elapsed time, and below it each stage with
+ * state, CPU usage since the previous frame, resident memory and bytes read and written.
+ *
+ * @param view The jobtop state, updated with this frame's CPU samples.
+ */
+static void render_jobtop(struct jobtop_view *view)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double since_ms = (now.tv_sec - view->last_frame.tv_sec) * 1000.0 +
+                      (now.tv_nsec - view->last_frame.tv_nsec) / 1000000.0;
+    double ticks_per_ms = sysconf(_SC_CLK_TCK) / 1000.0;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    size_t num_running = 0, num_stages = 0;
+    for (struct job *job = job_table; job; job = job->next)
+    {
+        num_running += job->running > 0;
+        num_stages += job->num_stages;
+    }
+    pid_t *pids = calloc(num_stages + 1, sizeof(pid_t));
+    unsigned long long *ticks = calloc(num_stages + 1, sizeof(unsigned long long));
+    if (!pids || !ticks)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    size_t num_samples = 0;
+
+    if (isatty(STDOUT_FILENO))
+        printf("\033[H\033[2J"); // Home the cursor and clear the screen.
+    printf("jobtop - %zu running job%s, refresh %.1fs\n", num_running, num_running == 1 ? "" : "s",
+           view->interval_ms / 1000.0);
+    printf("%-6s %-8s %-2s %6s %8s %8s %8s %9s  %s\n", "JOB", "PID", "ST", "CPU%", "RSS", "READ", "WRITE",
+           "ELAPSED", "COMMAND");
+    for (struct job *job = job_table; job; job = job->next)
+    {
+        long elapsed = now.tv_sec - job->started.tv_sec;
+        char job_id[16], elapsed_text[32];
+        snprintf(job_id, sizeof(job_id), "[%d]", job->id);
+        snprintf(elapsed_text, sizeof(elapsed_text), "%ld:%02ld:%02ld", elapsed / 3600, elapsed / 60 % 60,
+                 elapsed % 60);
+        printf("%-6s %-8s %-2s %6s %8s %8s %8s %9s  %s%s\n", job_id, "", "", "", "", "", "", elapsed_text,
+               job->cmdline, job->running > 0 ? "" : " (done)");
+        for (size_t i = 0; i < job->num_stages; i++)
+        {
+            const struct stage *stage = &job->stages[i];
+            struct proc_sample sample = {0};
+            if (stage->pid == 0 && !stage->finished)
+            {
+                printf("%-6s %-8s %-2s %6s %8s %8s %8s %9s  %s\n", "", "shell", "-", "-", "-", "-", "-", "",
+                       stage->argv[0]);
+                continue;
+            }
+            if (stage->finished || !read_proc_stat(stage->pid, &sample))
+            {
+                printf("%-6s %-8d %-2s %6s %8s %8s %8s %9s  %s (exited %d)\n", "", (int)stage->pid, "-", "-",
+                       "-", "-", "-", "", stage->argv[0], stage->status);
+                continue;
+            }
+            read_proc_io(stage->pid, &sample);
+            char cpu[16] = "-", rss[16], rchar[16], wchar[16];
+            for (size_t j = 0; j < view->num_samples; j++)
+            {
+                if (view->pids[j] == stage->pid && since_ms > 0)
+                    snprintf(cpu, sizeof(cpu), "%.1f", (sample.ticks - view->ticks[j]) / (ticks_per_ms * since_ms) * 100.0);
+            }
+            format_size((double)sample.rss_pages * page_size, rss, sizeof(rss));
+            format_size(sample.rchar, rchar, sizeof(rchar));
+            format_size(sample.wchar, wchar, sizeof(wchar));
+            printf("%-6s %-8d %-2c %6s %8s %8s %8s %9s  %s\n", "", (int)stage->pid, sample.state, cpu, rss, rchar,
+                   wchar, "", stage->argv[0]);
+            pids[num_samples] = stage->pid;
+            ticks[num_samples++] = sample.ticks;
+        }
+    }
+    fflush(stdout);
+
+    free(view->pids);
+    free(view->ticks);
+    view->pids = pids;
+    view->ticks = ticks;
+    view->num_samples = num_samples;
+    view->last_frame = now;
+}
+
+/**
+ * Event loop callback of the jobtop refresh timer.
+ */
+static void jobtop_tick(int fd, short revents, void *data)
+{
+    struct jobtop_view *view = data;
+    drain_timer(fd);
+    render_jobtop(view);
+    bool any_running = false;
+    for (struct job *job = job_table; job; job = job->next)
+        any_running |= job->running > 0;
+    if (!any_running || (view->frames_left > 0 && --view->frames_left == 0))
+        view->quit = true;
+}
+
+/**
+ * Event loop callback for keys pressed while jobtop runs on a terminal.
+ */
+static void jobtop_key(int fd, short revents, void *data)
+{
+    struct jobtop_view *view = data;
+    char key;
+    if (read(fd, &key, 1) <= 0 || key == 'q' || key == 'Q')
+        view->quit = true;
+}
+
+/**
+ * Shows a refreshing view of the background jobs and their stages until q is pressed, the given number
+ * of frames has been drawn or no job is running any more. Frames are drawn from the event loop, so
+ * jobs keep being reaped while the view is up.
+ */
+static int builtin_jobtop(size_t argc, char *argv[])
+{
+    struct jobtop_view view = {.interval_ms = 1000};
+    for (size_t i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "-n") == 0) && i + 1 < argc)
+        {
+            if (!parse_sampling_option("jobtop", argv[i], argv[i + 1], &view.interval_ms, &view.frames_left))
+                return 2;
+            i++;
+        }
+        else
+        {
+            fprintf(stderr, "jobtop: usage: jobtop [-i ms] [-n count]\n");
+            return 2;
+        }
+    }
+    reap_children();
+    if (!job_table)
+    {
+        printf("jobtop: no jobs\n");
+        return 0;
+    }
+
+    int timer = create_timer(view.interval_ms);
+    if (timer == -1)
+        return 1;
+    struct termios saved;
+    bool keys = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved) == 0;
+    if (keys)
+    {
+        struct termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO); // Deliver single key presses without echoing them.
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+        ev_add(STDIN_FILENO, POLLIN, jobtop_key, &view);
+    }
+    ev_add(timer, POLLIN, jobtop_tick, &view);
+
+    clock_gettime(CLOCK_MONOTONIC, &view.last_frame);
+    render_jobtop(&view);
+    if (view.frames_left == 1)
+        view.quit = true;
+    else if (view.frames_left > 1)
+        view.frames_left--;
+    while (!view.quit)
+        ev_wait(-1);
+
+    ev_remove(timer);
+    close(timer);
+    if (keys)
+    {
+        ev_remove(STDIN_FILENO);
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    }
+    free(view.pids);
+    free(view.ticks);
+    return 0;
+}
+
+/**
+ * The audit writer thread: every AUDIT_FLUSH_MS, or sooner when woken because the queue is filling up,
+ * it takes all queued records, writes them with a single write() and makes them durable with fsync().
+ * When asked to stop it drains the queue one last time.
+ */
+static void *audit_writer(void *arg)
+{
+    struct strbuf batch = {0};
+    while (1)
+    {
+        struct pollfd pfd = {.fd = audit.wake_fd, .events = POLLIN};
+        if (poll(&pfd, 1, AUDIT_FLUSH_MS) > 0)
+        {
+            uint64_t count;
+            if (read(audit.wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                perror("audit: eventfd");
+        }
+        bool stopping = atomic_load(&audit.stop);
+
+        size_t tail = atomic_load_explicit(&audit.tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&audit.head, memory_order_acquire);
+        for (; tail != head; tail++)
+        {
+            char *record = audit.slots[tail % AUDIT_QUEUE_SIZE];
+            strbuf_append(&batch, record, strlen(record));
+            free(record);
+        }
+        atomic_store_explicit(&audit.tail, tail, memory_order_release);
+        if (batch.len > 0)
+        {
+            if (!write_all(audit.fd, batch.data, batch.len) || fsync(audit.fd) == -1)
+                perror("audit");
+            batch.len = 0;
+        }
+        if (stopping && tail == atomic_load_explicit(&audit.head, memory_order_acquire))
+            break;
+    }
+    free(batch.data);
+    return NULL;
+}
+
+/**
+ * Wakes the audit writer before its next scheduled flush.
+ */
+static void wake_audit_writer(void)
+{
+    uint64_t one = 1;
+    if (write(audit.wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        perror("audit: eventfd");
+}
+
+/**
+ * Stops the audit writer after it has written and synced every queued record. Registered with atexit()
+ * so that the log is complete however the shell exits.
+ */
+static void close_audit_log(void)
+{
+    if (!audit.enabled)
+        return;
+    atomic_store(&audit.stop, true);
+    wake_audit_writer();
+    pthread_join(audit.thread, NULL);
+    close(audit.fd);
+    close(audit.wake_fd);
+    free(audit.user);
+    audit.enabled = false;
+}
+
+/**
+ * Records SIGTERM and SIGHUP so that the shell can exit through exit() and flush the audit log.
+ */
+static void handle_terminate(int sig)
+{
+    terminate_signal = sig;
+}
+
+static void append_varint(struct strbuf *buf, unsigned long long value)
+{
+    unsigned char bytes[10];
+    size_t len = 0;
+    do
+    {
+        bytes[len] = value & 0x7f;
+        value >>= 7;
+        bytes[len] |= value ? 0x80 : 0;
+        len++;
+    } while (value);
+    strbuf_append(buf, (const char *)bytes, len);
+}
+
+/**
+ * Starts a session recording.
+ *
+ * @param path The recording, created or truncated.
+ * @return false if it could not be created (an error has been printed).
+ */
+static bool open_recording(const char *path)
+{
+    recording.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (recording.fd == -1 || !write_all(recording.fd, RECORDING_MAGIC, strlen(RECORDING_MAGIC)))
+    {
+        perror(path);
+        if (recording.fd != -1)
+            close(recording.fd);
+        recording.fd = -1;
+        return false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &recording.last);
+    return true;
+}
+
+/**
+ * Runs a command line typed by the user, recording it when --record is in effect. Each record is
+ * written as soon as the command has finished, with one write(), so a recording is complete up to
+ * the last command even if the shell is killed.
+ *
+ * @param line The line, with its newline; it is modified.
+ */
+static void run_recorded(char *line)
+{
+    if (recording.fd == -1)
+    {
+        parse_cmd(line);
+        return;
+    }
+    size_t line_len = strcspn(line, "\n");
+    char *text = strndup(line, line_len);
+    char *cwd = getcwd(NULL, 0);
+    struct timespec submitted, finished;
+    clock_gettime(CLOCK_MONOTONIC, &submitted);
+    parse_cmd(line);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    struct strbuf record = {0};
+    append_varint(&record, (submitted.tv_sec - recording.last.tv_sec) * 1000000LL +
+                               (submitted.tv_nsec - recording.last.tv_nsec) / 1000);
+    append_varint(&record, (finished.tv_sec - submitted.tv_sec) * 1000000LL +
+                               (finished.tv_nsec - submitted.tv_nsec) / 1000);
+    append_varint(&record, last_status & 0xff);
+    bool moved = cwd && (!recording.cwd || strcmp(cwd, recording.cwd) != 0);
+    append_varint(&record, moved ? strlen(cwd) : 0);
+    if (moved)
+        strbuf_append(&record, cwd, strlen(cwd));
+    append_varint(&record, line_len);
+    strbuf_append(&record, text, line_len);
+    if (!write_all(recording.fd, record.data, record.len))
+    {
+        perror("record");
+        close(recording.fd);
+        recording.fd = -1;
+    }
+    if (moved)
+    {
+        free(recording.cwd);
+        recording.cwd = cwd;
+    }
+    else
+        free(cwd);
+    recording.last = submitted;
+    free(record.data);
+    free(text);
+}
+
+/**
+ * Opens the audit log and starts its writer thread.
+ *
+ * @param path The log file, created if needed and appended to.
+ * @return false if the log could not be opened (an error has been printed).
+ */
+static bool open_audit_log(const char *path)
+{
+    audit.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (audit.fd == -1)
+    {
+        perror(path);
+        return false;
+    }
+    audit.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct passwd *pw = getpwuid(getuid());
+    char uid[16];
+    snprintf(uid, sizeof(uid), "%d", (int)getuid());
+    audit.user = strdup(pw ? pw->pw_name : uid);
+    if (audit.wake_fd == -1 || pthread_create(&audit.thread, NULL, audit_writer, NULL) != 0)
+    {
+        perror("audit");
+        close(audit.fd);
+        return false;
+    }
+    audit.enabled = true;
+    atexit(close_audit_log);
+
+    struct sigaction sa = {.sa_handler = handle_terminate};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    return true;
+}
+
+/**
+ * Queues an audit record for a finished command: start time, user, working directory, the argument
+ * vector of every stage, exit status and duration. Only blocks if the writer has fallen a whole queue
+ * behind, since records must not be lost.
+ *
+ * @param stages The stages of the command.
+ * @param num_stages The number of stages.
+ * @param cwd The directory the command was started in.
+ * @param submitted Wall clock time the command was started.
+ * @param duration_ms How long the command ran.
+ * @param status The command's exit status.
+ */
+static void audit_command(const struct stage *stages, size_t num_stages, const char *cwd, struct timespec submitted,
+                          double duration_ms, int status)
+{
+    if (!audit.enabled)
+        return;
+    struct tm tm;
+    char time_text[32];
+    gmtime_r(&submitted.tv_sec, &tm);
+    strftime(time_text, sizeof(time_text), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    struct strbuf record = {0};
+    strbuf_appendf(&record, "{\"time\":\"%s.%03ldZ\",\"user\":", time_text, submitted.tv_nsec / 1000000);
+    strbuf_append_json(&record, audit.user);
+    strbuf_append(&record, ",\"cwd\":", 7);
+    strbuf_append_json(&record, cwd);
+    strbuf_append(&record, ",\"argv\":[", 9);
+    for (size_t s = 0; s < num_stages; s++)
+    {
+        strbuf_append(&record, s ? ",[" : "[", s ? 2 : 1);
+        for (size_t i = 0; i < stages[s].argc; i++)
+        {
+            if (i > 0)
+                strbuf_append(&record, ",", 1);
+            strbuf_append_json(&record, stages[s].argv[i]);
+        }
+        strbuf_append(&record, "]", 1);
+    }
+    strbuf_appendf(&record, "],\"status\":%d,\"duration_ms\":%.3f}\n", status, duration_ms);
+
+    size_t head = atomic_load_explicit(&audit.head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&audit.tail, memory_order_acquire) == AUDIT_QUEUE_SIZE)
+    {
+        wake_audit_writer(); // Full: let the writer catch up rather than drop the record.
+        sched_yield();
+    }
+    audit.slots[head % AUDIT_QUEUE_SIZE] = record.data;
+    atomic_store_explicit(&audit.head, head + 1, memory_order_release);
+    if (head + 1 - atomic_load_explicit(&audit.tail, memory_order_acquire) >= AUDIT_QUEUE_SIZE / 2)
+        wake_audit_writer();
+}
+
+/**
+ * Parses a time span such as 90, 90s, 10m, 2h or 1d.
+ *
+ * @param str The span.
+ * @param seconds Receives the span in seconds.
+ * @return false if str is not a valid span.
+ */
+static bool parse_span(const char *str, double *seconds)
+{
+    char *end;
+    double value = strtod(str, &end);
+    if (end == str || value < 0)
+        return false;
+    const char *units = "smhd";
+    const double scale[] = {1, 60, 3600, 86400};
+    if (*end == '\0')
+    {
+        *seconds = value;
+        return true;
+    }
+    const char *unit = strchr(units, *end);
+    if (!unit || end[1] != '\0')
+        return false;
+    *seconds = value * scale[unit - units];
+    return true;
+}
+
+/**
+ * Parses a positive decimal count.
+ *
+ * @param str The count.
+ * @param count Receives the count.
+ * @return false if str is not a number, has trailing characters, is not positive or overflows a long.
+ */
+static bool parse_count(const char *str, long *count)
+{
+    char *end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || value <= 0 || errno != 0)
+        return false;
+    *count = value;
+    return true;
+}
+
+/**
+ * Adds a finished command to the history, dropping the oldest entry once HISTORY_MAX are kept.
+ *
+ * @param entry The entry; the history takes ownership of its cmdline.
+ */
+static void add_history(struct history_entry entry)
+{
+    if (history.len == HISTORY_MAX)
+    {
+        free(history.entries[0].cmdline);
+        memmove(history.entries, history.entries + 1, (history.len - 1) * sizeof(struct history_entry));
+        history.len--;
+    }
+    if (history.len == history.cap)
+    {
+        history.cap = history.cap ? history.cap * 2 : 64;
+        history.entries = realloc(history.entries, history.cap * sizeof(struct history_entry));
+        if (!history.entries)
+        {
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    history.entries[history.len++] = entry;
+}
+
+/**
+ * Called once a command has finished: adds it to the history with the CPU time and memory its
+ * processes used, as collected by reap_children, writes it to the audit log and, if it ran for at
+ * least $REPORTTIME seconds, reports its resource usage.
+ *
+ * @param cmdline The command as typed.
+ * @param stages The stages of the command.
+ * @param num_stages The number of stages.
+ * @param cwd The directory the command was started in.
+ * @param submitted Wall clock time the command was started.
+ * @param started Monotonic time the command was started.
+ * @param finished Monotonic time its last stage ended, which for a background job is earlier than when
+ *                 it is reported.
+ * @param status The command's exit status.
+ */
+static void finish_command(const char *cmdline, const struct stage *stages, size_t num_stages, const char *cwd,
+                           struct timespec submitted, struct timespec started, struct timespec finished, int status)
+{
+    struct history_entry entry = {.start = submitted.tv_sec, .status = status};
+    entry.wall = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    for (size_t i = 0; i < num_stages; i++)
+    {
+        const struct rusage *usage = &stages[i].usage;
+        entry.cpu += usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+        entry.cpu += usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+        if (usage->ru_maxrss > entry.maxrss)
+            entry.maxrss = usage->ru_maxrss;
+    }
+    entry.cmdline = strdup(cmdline);
+    add_history(entry);
+    stats.exit_statuses[status & 0xff]++;
+    hdr_record(&stats.wall_time, entry.wall * 1e9);
+    sample_heap_usage(NULL);
+    audit_command(stages, num_stages, cwd, submitted, entry.wall * 1e3, status);
+
+    const char *threshold = get_var("REPORTTIME");
+    double report_after;
+    if (threshold && parse_span(threshold, &report_after) && entry.wall >= report_after)
+    {
+        char rss[16];
+        format_size(entry.maxrss * 1024.0, rss, sizeof(rss));
+        fprintf(stderr, "%s: %.2fs real, %.2fs cpu, %s max rss, status %d\n", cmdline, entry.wall, entry.cpu, rss,
+                status);
+    }
+}
+
+/**
+ * Prints a history entry as one row of the history and slowest tables.
+ */
+static void print_history_entry(const struct history_entry *entry)
+{
+    char when[16], rss[16];
+    struct tm tm;
+    localtime_r(&entry->start, &tm);
+    strftime(when, sizeof(when), "%H:%M:%S", &tm);
+    format_size(entry->maxrss * 1024.0, rss, sizeof(rss));
+    printf("%s %9.3fs %9.3fs %7s %6d  %s\n", when, entry->wall, entry->cpu, rss, entry->status, entry->cmdline);
+}
+
+/**
+ * Lists the history, or its last count entries, with start time, duration, CPU time, peak memory and
+ * exit status of each command.
+ */
+static int builtin_history(size_t argc, char *argv[])
+{
+    size_t first = 0;
+    if (argc > 1)
+    {
+        char *end;
+        long count = strtol(argv[1], &end, 10);
+        if (*end != '\0' || count < 0)
+        {
+            fprintf(stderr, "history: %s: invalid count\n", argv[1]);
+            return 2;
+        }
+        if ((size_t)count < history.len)
+            first = history.len - count;
+    }
+    printf("%5s  %-8s %10s %10s %7s %6s  %s\n", "NUM", "START", "WALL", "CPU", "RSS", "STATUS", "COMMAND");
+    for (size_t i = first; i < history.len; i++)
+    {
+        printf("%5zu  ", i + 1);
+        print_history_entry(&history.entries[i]);
+    }
+    return 0;
+}
+
+static int compare_wall(const void *a, const void *b)
+{
+    const struct history_entry *x = *(const struct history_entry *const *)a;
+    const struct history_entry *y = *(const struct history_entry *const *)b;
+    return (x->wall < y->wall) - (x->wall > y->wall);
+}
+
+static int compare_cpu(const void *a, const void *b)
+{
+    const struct history_entry *x = *(const struct history_entry *const *)a;
+    const struct history_entry *y = *(const struct history_entry *const *)b;
+    return (x->cpu < y->cpu) - (x->cpu > y->cpu);
+}
+
+/**
+ * How often a command line failed, for 'slowest -f'.
+ */
+struct failure_count
+{
+    const char *cmdline;
+    size_t failures;
+    size_t runs;
+};
+
+static int compare_failures(const void *a, const void *b)
+{
+    const struct failure_count *x = a, *y = b;
+    if (x->failures != y->failures)
+        return (x->failures < y->failures) - (x->failures > y->failures);
+    return (x->runs > y->runs) - (x->runs < y->runs); // Same failures: the lower failure rate last.
+}
+
+/**
+ * Lists the commands of the history that took the longest, used the most CPU (-c) or failed most
+ * often (-f), optionally only those started between -s and -u ago.
+ */
+static int builtin_slowest(size_t argc, char *argv[])
+{
+    bool by_cpu = false, by_failures = false;
+    long count = 10;
+    double since = -1, until = 0;
+    for (size_t i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0)
+            by_cpu = true;
+        else if (strcmp(argv[i], "-f") == 0)
+            by_failures = true;
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc && parse_count(argv[++i], &count))
+            continue;
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc && parse_span(argv[++i], &since))
+            continue;
+        else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc && parse_span(argv[++i], &until))
+            continue;
+        else
+        {
+            fprintf(stderr, "usage: slowest [-c|-f] [-n count] [-s since] [-u until]\n");
+            return 2;
+        }
+    }
+
+    time_t now = time(NULL);
+    const struct history_entry **matches = malloc((history.len + 1) * sizeof(*matches));
+    struct failure_count *failures = calloc(history.len + 1, sizeof(*failures));
+    if (!matches || !failures)
+    {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    size_t num_matches = 0, num_failures = 0;
+    for (size_t i = 0; i < history.len; i++)
+    {
+        const struct history_entry *entry = &history.entries[i];
+        if ((since >= 0 && entry->start < now - since) || entry->start > now - until)
+            continue;
+        matches[num_matches++] = entry;
+        size_t j = 0;
+        while (j < num_failures && strcmp(failures[j].cmdline, entry->cmdline) != 0)
+            j++;
+        if (j == num_failures)
+            failures[num_failures++].cmdline = entry->cmdline;
+        failures[j].runs++;
+        failures[j].failures += entry->status != 0;
+    }
+
+    if (by_failures)
+    {
+        qsort(failures, num_failures, sizeof(*failures), compare_failures);
+        printf("%6s %6s  %s\n", "FAILS", "RUNS", "COMMAND");
+        for (size_t i = 0; i < num_failures && i < (size_t)count && failures[i].failures > 0; i++)
+            printf("%6zu %6zu  %s\n", failures[i].failures, failures[i].runs, failures[i].cmdline);
+    }
+    else
+    {
+        qsort(matches, num_matches, sizeof(*matches), by_cpu ? compare_cpu : compare_wall);
+        printf("%-8s %10s %10s %7s %6s  %s\n", "START", "WALL", "CPU", "RSS", "STATUS", "COMMAND");
+        for (size_t i = 0; i < num_matches && i < (size_t)count; i++)
+            print_history_entry(matches[i]);
+    }
+    free(matches);
+    free(failures);
+    return 0;
+}
+
+/**
+ * Finds the counter of a histogram covering a value.
+ */
+static size_t hdr_index(uint64_t value)
+{
+    if (value >= (uint64_t)1 << HDR_MAX_BITS)
+        value = ((uint64_t)1 << HDR_MAX_BITS) - 1;
+    int msb = 63 - __builtin_clzll(value | (HDR_SUB_BUCKETS - 1));
+    int bucket = msb - (HDR_SUB_BUCKET_BITS - 1);
+    return ((size_t)bucket << (HDR_SUB_BUCKET_BITS - 1)) + (value >> bucket);
+}
+
+/**
+ * @return The largest value counted by a histogram counter.
+ */
+static uint64_t hdr_value(size_t index)
+{
+    if (index < HDR_SUB_BUCKETS)
+        return index;
+    int bucket = index / (HDR_SUB_BUCKETS / 2) - 1;
+    uint64_t sub_bucket = index - ((size_t)bucket << (HDR_SUB_BUCKET_BITS - 1));
+    return ((sub_bucket + 1) << bucket) - 1;
+}
+
+/**
+ * Records a latency in a histogram.
+ *
+ * @param hist The histogram.
+ * @param ns The latency in nanoseconds.
+ */
+static void hdr_record(struct hdr_histogram *hist, double ns)
+{
+    uint64_t value = ns > 0 ? (uint64_t)ns : 0;
+    hist->counts[hdr_index(value)]++;
+    hist->total++;
+    hist->sum += value;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+/**
+ * @param hist The histogram.
+ * @param percentile The percentile, such as 99.9.
+ * @return The value below which the given percentage of the recorded values fall, in nanoseconds.
+ */
+static uint64_t hdr_percentile(const struct hdr_histogram *hist, double percentile)
+{
+    unsigned long wanted = (unsigned long)(percentile / 100 * hist->total + 0.999999);
+    unsigned long seen = 0;
+    for (size_t i = 0; i < HDR_COUNTS && hist->total > 0; i++)
+    {
+        seen += hist->counts[i];
+        if (seen >= (wanted ? wanted : 1))
+            return hdr_value(i) < hist->max ? hdr_value(i) : hist->max;
+    }
+    return hist->max;
+}
+
+/**
+ * Formats a duration in nanoseconds with a unit that keeps it short, such as "81.2us".
+ */
+static void format_duration(double ns, char *buf, size_t size)
+{
+    if (ns < 1e3)
+        snprintf(buf, size, "%.0fns", ns);
+    else if (ns < 1e6)
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    else if (ns < 1e9)
+        snprintf(buf, size, "%.2fms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+}
+
+/**
+ * Reads the result of a forked stage's exec status pipe: EOF means the exec succeeded, otherwise the
+ * child sent the errno of the failed exec, or 0 if it exited before trying. The time from fork to a
+ * successful exec goes into the exec histogram.
+ *
+ * @param stage The stage, whose exec_fd is closed.
+ * @return The errno of the failed exec, or 0.
+ */
+static int finish_exec_wait(struct stage *stage)
+{
+    int err;
+    ssize_t n;
+    do
+        n = read(stage->exec_fd, &err, sizeof(err));
+    while (n == -1 && errno == EINTR);
+    if (n == 0)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        hdr_record(&stats.exec_latency,
+                   (now.tv_sec - stage->forked.tv_sec) * 1e9 + (now.tv_nsec - stage->forked.tv_nsec));
+    }
+    close(stage->exec_fd);
+    stage->exec_fd = -1;
+    if (n != sizeof(err) || err == 0)
+        return 0; // Exec'd, or exited before trying (see exit_before_exec).
+    stats.exec_failures++;
+    return err;
+}
+
+/**
+ * Event loop callback of an exec status pipe, registered as soon as the stage is forked so that
+ * spawning a pipeline never waits for one stage to exec before forking the next. When the stage's
+ * program could not be executed, the stages after it are killed and end with the same 126 or 127
+ * status: their input is empty, so they could only produce misleading output. One that has already
+ * finished keeps its own status.
+ */
+static void exec_status_event(int fd, short revents, void *data)
+{
+    struct job *job = data;
+    size_t idx = 0;
+    while (idx < job->num_stages && job->stages[idx].exec_fd != fd)
+        idx++;
+    ev_remove(fd);
+    if (idx == job->num_stages)
+        return;
+    int err = finish_exec_wait(&job->stages[idx]);
+    if (!err)
+        return;
+    for (size_t i = idx + 1; i < job->num_stages; i++)
+    {
+        struct stage *stage = &job->stages[i];
+        if (stage->finished)
+            continue;
+        if (stage->pid > 0)
+        {
+            stage->cancel_status = exec_failure_status(err);
+            kill(stage->pid, SIGKILL);
+        }
+        else if (stage->pid == 0 && stage->limiter && !stage->limiter->done)
+            finish_rate_limiter(stage->limiter, exec_failure_status(err));
+    }
+}
+
+/**
+ * Shows percentiles of the time fork() takes, of the time from fork() to a successful exec, and of the
+ * wall time of whole commands, recorded in HDR histograms since the shell started or was last reset.
+ * With -r the histograms are cleared.
+ */
+static int builtin_latency(size_t argc, char *argv[])
+{
+    bool reset = argc > 1 && strcmp(argv[1], "-r") == 0;
+    if (argc > 2 || (argc == 2 && !reset))
+    {
+        fprintf(stderr, "usage: latency [-r]\n");
+        return 2;
+    }
+    struct
+    {
+        const char *name;
+        struct hdr_histogram *hist;
+    } rows[] = {{"spawn", &stats.spawn_latency}, {"exec", &stats.exec_latency}, {"command", &stats.wall_time}};
+    const double percentiles[] = {50, 90, 99, 99.9};
+    if (reset)
+    {
+        for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++)
+            memset(rows[i].hist, 0, sizeof(struct hdr_histogram));
+        return 0;
+    }
+    printf("%-8s %8s %9s %9s %9s %9s %9s\n", "", "count", "p50", "p90", "p99", "p999", "max");
+    for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++)
+    {
+        printf("%-8s %8lu", rows[i].name, rows[i].hist->total);
+        char value[16];
+        for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++)
+        {
+            format_duration(hdr_percentile(rows[i].hist, percentiles[p]), value, sizeof(value));
+            printf(" %9s", value);
+        }
+        format_duration(rows[i].hist->max, value, sizeof(value));
+        printf(" %9s\n", value);
+    }
+    return 0;
+}
+
+/**
+ * Records how long a successful fork() took.
+ *
+ * @param start When fork() was called.
+ */
+static void record_spawn(struct timespec start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double us = (now.tv_sec - start.tv_sec) * 1e6 + (now.tv_nsec - start.tv_nsec) / 1e3;
+    stats.spawns_fork++;
+    hdr_record(&stats.spawn_latency, us * 1e3);
+}
+
+/**
+ * Measures the heap (the main arena plus mmap()ed blocks) and raises the high-water mark.
+ *
+ * @param in_use Receives the bytes allocated and not freed, or NULL.
+ * @return The bytes the allocator holds from the kernel.
+ */
+static size_t sample_heap_usage(size_t *in_use)
+{
+    struct mallinfo2 info = mallinfo2();
+    size_t held = info.arena + info.hblkhd;
+    if (held > stats.heap_high_water)
+        stats.heap_high_water = held;
+    if (in_use)
+        *in_use = info.uordblks + info.hblkhd;
+    return held;
+}
+
+/**
+ * Counts the shell's open file descriptors.
+ */
+static size_t count_open_fds(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir)
+        return 0;
+    size_t count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+        count += entry->d_name[0] != '.';
+    closedir(dir);
+    return count - 1; // Not counting the descriptor of the directory listing itself.
+}
+
+/**
+ * Reads a "Name:   value kB" field of /proc/self/status.
+ *
+ * @return The value in bytes, or 0 if it is missing.
+ */
+static size_t read_status_kb(const char *name)
+{
+    FILE *file = fopen("/proc/self/status", "r");
+    if (!file)
+        return 0;
+    char line[256];
+    size_t len = strlen(name), kb = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        if (strncmp(line, name, len) == 0 && line[len] == ':')
+        {
+            kb = strtoul(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(file);
+    return kb * 1024;
+}
+
+/**
+ * Shows the shell's own counters: commands parsed, stages started per backend with fork() latency,
+ * PATH cache effectiveness, memory, descriptors, event loop wakeups and thread pool activity. With -j
+ * they are printed as one JSON object for monitoring agents.
+ */
+static int builtin_shstat(size_t argc, char *argv[])
+{
+    bool json = argc > 1 && strcmp(argv[1], "-j") == 0;
+    if (argc > 2 || (argc == 2 && !json))
+    {
+        fprintf(stderr, "usage: shstat [-j]\n");
+        return 2;
+    }
+    const struct hdr_histogram *spawn = &stats.spawn_latency;
+    double avg_us = spawn->total ? spawn->sum / spawn->total / 1e3 : 0;
+    double p99_us = hdr_percentile(spawn, 99) / 1e3;
+    size_t heap_in_use;
+    size_t heap = sample_heap_usage(&heap_in_use);
+    size_t rss_high_water = read_status_kb("VmHWM");
+    size_t open_fds = count_open_fds();
+    pthread_mutex_lock(&pool.lock);
+    unsigned long pool_tasks = pool.submitted, pool_steals = pool.steals;
+    pthread_mutex_unlock(&pool.lock);
+
+    const struct
+    {
+        const char *name;
+        double value;
+        const char *format;
+    } counters[] = {
+        {"commands_parsed", stats.commands_parsed, "%.0f"},
+        {"spawns_fork", stats.spawns_fork, "%.0f"},
+        {"spawns_shell", stats.spawns_shell, "%.0f"},
+        {"spawn_failures", stats.spawn_failures, "%.0f"},
+        {"exec_failures", stats.exec_failures, "%.0f"},
+        {"spawn_avg_us", avg_us, "%.1f"},
+        {"spawn_p99_us", p99_us, "%.1f"},
+        {"path_cache_hits", path_cache.hits, "%.0f"},
+        {"path_cache_misses", path_cache.misses, "%.0f"},
+        {"parse_cache_hits", parse_cache.hits, "%.0f"},
+        {"parse_cache_misses", parse_cache.misses, "%.0f"},
+        {"heap_bytes", heap, "%.0f"},
+        {"heap_in_use_bytes", heap_in_use, "%.0f"},
+        {"heap_high_water_bytes", stats.heap_high_water, "%.0f"},
+        {"rss_high_water_bytes", rss_high_water, "%.0f"},
+        {"open_fds", open_fds, "%.0f"},
+        {"event_loop_wakeups", loop.wakeups, "%.0f"},
+        {"history_entries", history.len, "%.0f"},
+        {"prefetched_files", prefetched_files, "%.0f"},
+        {"pool_workers", pool.num_workers, "%.0f"},
+        {"pool_tasks", pool_tasks, "%.0f"},
+        {"pool_steals", pool_steals, "%.0f"},
+    };
+    size_t num_counters = sizeof(counters) / sizeof(counters[0]);
+    struct strbuf out = {0};
+    strbuf_append(&out, json ? "{" : "", json);
+    for (size_t i = 0; i < num_counters; i++)
+    {
+        if (json)
+            strbuf_appendf(&out, "%s\"%s\":", i ? "," : "", counters[i].name);
+        else
+            strbuf_appendf(&out, "%-22s ", counters[i].name);
+        strbuf_appendf(&out, counters[i].format, counters[i].value);
+        strbuf_append(&out, json ? "" : "\n", !json);
+    }
+    strbuf_append(&out, json ? "}\n" : "", json ? 2 : 0);
+    fwrite(out.data, 1, out.len, stdout);
+    free(out.data);
+    return 0;
+}
+
+/**
+ * Appends one metric in Prometheus text exposition format.
+ *
+ * @param out The exposition being built.
+ * @param name The metric name.
+ * @param type "counter" or "gauge".
+ * @param help The HELP text.
+ * @param value The value.
+ */
+static void append_metric(struct strbuf *out, const char *name, const char *type, const char *help, double value)
+{
+    strbuf_appendf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+/**
+ * Renders the shell's metrics in Prometheus text exposition format (version 0.0.4).
+ *
+ * @param out Receives the exposition.
+ */
+static void render_metrics(struct strbuf *out)
+{
+    append_metric(out, "shell_commands_parsed_total", "counter", "Command lines parsed.", stats.commands_parsed);
+
+    strbuf_appendf(out, "# HELP shell_commands_total Commands finished, by exit status.\n"
+                        "# TYPE shell_commands_total counter\n");
+    for (int status = 0; status < 256; status++)
+    {
+        if (stats.exit_statuses[status] > 0)
+            strbuf_appendf(out, "shell_commands_total{status=\"%d\"} %lu\n", status, stats.exit_statuses[status]);
+    }
+
+    strbuf_appendf(out,
+                   "# HELP shell_spawns_total Pipeline stages started, by backend.\n"
+                   "# TYPE shell_spawns_total counter\n"
+                   "shell_spawns_total{backend=\"fork\"} %lu\n"
+                   "shell_spawns_total{backend=\"shell\"} %lu\n",
+                   stats.spawns_fork, stats.spawns_shell);
+    append_metric(out, "shell_spawn_failures_total", "counter", "Forks that failed.", stats.spawn_failures);
+    append_metric(out, "shell_exec_failures_total", "counter", "Programs that could not be executed.",
+                  stats.exec_failures);
+
+    // The buckets are summed from the HDR histogram that shstat and latency report from too. A counter
+    // straddling a bound counts above it, so a bucket may be short by values within 1% of its bound.
+    const struct hdr_histogram *spawn = &stats.spawn_latency;
+    strbuf_appendf(out, "# HELP shell_spawn_latency_seconds Time taken by fork().\n"
+                        "# TYPE shell_spawn_latency_seconds histogram\n");
+    unsigned long cumulative = 0;
+    size_t idx = 0;
+    for (size_t i = 0; i < SPAWN_BUCKETS; i++)
+    {
+        for (; idx < HDR_COUNTS && hdr_value(idx) <= spawn_bucket_bounds[i] * 1e9; idx++)
+            cumulative += spawn->counts[idx];
+        strbuf_appendf(out, "shell_spawn_latency_seconds_bucket{le=\"%g\"} %lu\n", spawn_bucket_bounds[i], cumulative);
+    }
+    strbuf_appendf(out,
+                   "shell_spawn_latency_seconds_bucket{le=\"+Inf\"} %lu\n"
+                   "shell_spawn_latency_seconds_sum %.9f\n"
+                   "shell_spawn_latency_seconds_count %lu\n",
+                   spawn->total, spawn->sum / 1e9, spawn->total);
+
+    size_t running = 0;
+    for (struct job *job = next_job(NULL); job; job = next_job(job))
+        running += job_active(job);
+    append_metric(out, "shell_jobs_running", "gauge", "Jobs with stages still running.", running);
+
+    struct rusage children;
+    getrusage(RUSAGE_CHILDREN, &children);
+    strbuf_appendf(out,
+                   "# HELP shell_child_cpu_seconds_total CPU time of reaped children.\n"
+                   "# TYPE shell_child_cpu_seconds_total counter\n"
+                   "shell_child_cpu_seconds_total{mode=\"user\"} %.6f\n"
+                   "shell_child_cpu_seconds_total{mode=\"system\"} %.6f\n",
+                   children.ru_utime.tv_sec + children.ru_utime.tv_usec / 1e6,
+                   children.ru_stime.tv_sec + children.ru_stime.tv_usec / 1e6);
+
+    append_metric(out, "shell_path_cache_hits_total", "counter", "PATH cache hits.", path_cache.hits);
+    append_metric(out, "shell_path_cache_misses_total", "counter", "PATH cache misses.", path_cache.misses);
+    append_metric(out, "shell_event_loop_wakeups_total", "counter", "Event loop wakeups.", loop.wakeups);
+    append_metric(out, "shell_heap_bytes", "gauge", "Bytes the allocator holds.", sample_heap_usage(NULL));
+    append_metric(out, "shell_open_fds", "gauge", "Open file descriptors.", count_open_fds());
+}
+
+/**
+ * Thread pool task replacing the metrics file: the exposition is written to a temporary file that is
+ * then renamed over the old one, so the textfile collector never reads a partial file.
+ */
+static void write_metrics_file(void *arg)
+{
+    char *text = arg;
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", metrics.file);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || !write_all(fd, text, strlen(text)) || close(fd) == -1 || rename(tmp, metrics.file) == -1)
+    {
+        perror(metrics.file);
+        if (fd != -1)
+            unlink(tmp);
+    }
+    free(text);
+    atomic_store(&metrics.writing, false);
+}
+
+/**
+ * Event loop callback of the metrics timer: hands a fresh exposition to the thread pool for writing,
+ * unless the previous one is still being written.
+ */
+static void export_metrics_tick(int fd, short revents, void *data)
+{
+    drain_timer(fd);
+    if (atomic_exchange(&metrics.writing, true))
+        return;
+    struct strbuf text = {0};
+    render_metrics(&text);
+    pool_submit(write_metrics_file, text.data, POOL_PRIORITIES - 1, true);
+}
+
+/**
+ * Closes a metrics client connection and frees it.
+ */
+static void close_metrics_client(struct metrics_client *client)
+{
+    ev_remove(client->fd);
+    close(client->fd);
+    ev_remove(client->timer_fd);
+    close(client->timer_fd);
+    free(client->response.data);
+    free(client);
+}
+
+/**
+ * Event loop callback of a metrics client's idle timer: drops a client that neither reads the
+ * response nor hangs up, which would otherwise hold its descriptor and buffer forever.
+ */
+static void metrics_client_idle(int fd, short revents, void *data)
+{
+    close_metrics_client(data);
+}
+
+/**
+ * Event loop callback of a metrics client connection: sends the rest of the response, then reads
+ * whatever the client sent until it hangs up. Closing with the request unread would reset the
+ * connection and could lose the response.
+ */
+static void metrics_client_event(int fd, short revents, void *data)
+{
+    struct metrics_client *client = data;
+    struct itimerspec idle = {{0, 0}, {METRICS_IDLE_MS / 1000, (METRICS_IDLE_MS % 1000) * 1000000L}};
+    timerfd_settime(client->timer_fd, 0, &idle, NULL); // Any event is progress; restart the idle timer.
+    if (client->sent < client->response.len)
+    {
+        while (client->sent < client->response.len)
+        {
+            ssize_t n = send(fd, client->response.data + client->sent, client->response.len - client->sent,
+                             MSG_NOSIGNAL);
+            if (n == -1 && (errno == EAGAIN || errno == EINTR))
+                return;
+            if (n == -1)
+                break;
+            client->sent += n;
+        }
+        client->sent = client->response.len;
+        shutdown(fd, SHUT_WR);
+        ev_remove(fd);
+        ev_add(fd, POLLIN, metrics_client_event, client);
+        return;
+    }
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        ;
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    close_metrics_client(client);
+}
+
+/**
+ * Event loop callback of the metrics socket: answers each connection with an HTTP response carrying
+ * the exposition, written as the client reads it so that a slow client cannot stall the shell.
+ */
+static void metrics_accept(int fd, short revents, void *data)
+{
+    int client_fd;
+    while ((client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+    {
+        struct metrics_client *client = calloc(1, sizeof(struct metrics_client));
+        if (!client)
+        {
+            perror("calloc failed");
+            exit(EXIT_FAILURE);
+        }
+        client->fd = client_fd;
+        client->timer_fd = create_timer(METRICS_IDLE_MS);
+        if (client->timer_fd == -1)
+        {
+            close(client_fd);
+            free(client);
+            continue;
+        }
+        struct strbuf body = {0};
+        render_metrics(&body);
+        strbuf_appendf(&client->response,
+                       "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                       body.len);
+        strbuf_append(&client->response, body.data, body.len);
+        free(body.data);
+        ev_add(client_fd, POLLOUT, metrics_client_event, client);
+        ev_add(client->timer_fd, POLLIN, metrics_client_idle, client);
+    }
+}
+
+/**
+ * Removes the metrics socket at exit.
+ */
+static void remove_metrics_socket(void)
+{
+    unlink(metrics.socket_path);
+}
+
+/**
+ * Listens for metrics scrapes on a Unix socket, replacing a stale socket left at the path. A socket
+ * that still accepts connections belongs to a running shell and is left alone.
+ *
+ * @return false if the socket could not be set up (an error has been printed).
+ */
+static bool listen_metrics_socket(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool live = probe != -1 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        bool stale = !live && probe != -1 && errno == ECONNREFUSED;
+        if (probe != -1)
+            close(probe);
+        if (live)
+        {
+            fprintf(stderr, "%s: socket in use by another process\n", path);
+            return false;
+        }
+        if (stale)
+            unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1)
+    {
+        perror(path);
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+    snprintf(metrics.socket_path, sizeof(metrics.socket_path), "%s", path);
+    atexit(remove_metrics_socket);
+    ev_add(fd, POLLIN, metrics_accept, NULL);
+    return true;
+}
+
+/**
+ * Starts exporting metrics: rewritten every interval seconds to a file for node_exporter's textfile
+ * collector, and/or served to every client connecting to a Unix socket.
+ *
+ * @param file The file to write, or NULL.
+ * @param socket_path The socket to listen on, or NULL.
+ * @param interval Seconds between file updates.
+ * @return false if the export could not be set up (an error has been printed).
+ */
+static bool export_metrics(const char *file, const char *socket_path, double interval)
+{
+    if (socket_path && !listen_metrics_socket(socket_path))
+        return false;
+    if (!file)
+        return true;
+    if (strlen(file) >= sizeof(metrics.file))
+    {
+        fprintf(stderr, "%s: path too long\n", file);
+        return false;
+    }
+    snprintf(metrics.file, sizeof(metrics.file), "%s", file);
+    long interval_ms = interval * 1000;
+    int timer = create_timer(interval_ms > 0 ? interval_ms : 1000);
+    if (timer == -1)
+        return false;
+    ev_add(timer, POLLIN, export_metrics_tick, NULL);
+    export_metrics_tick(timer, POLLIN, NULL); // Write the file right away rather than after a whole interval.
+    return true;
+}
+
+/**
+ * Opens the perfstat counters on a forked stage before it execs. The counters are inherited by the
+ * stage's own children and, for a program, only start counting at its exec, so the shell's share of
+ * the child does not show. Hardware counters the kernel refuses (perf_event_paranoid, or no PMU in a
+ * virtual machine) are left closed and the software ones still count.
+ *
+ * @param perf The stage's counters.
+ * @param pid The stage's process, which waits for the counters before it execs.
+ * @param execs Whether the stage execs a program rather than running a builtin.
+ */
+static void open_perf_counters(struct perf_stage *perf, pid_t pid, bool execs)
+{
+    FILE *file = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+    int paranoid = 2;
+    if (file)
+    {
+        if (fscanf(file, "%d", &paranoid) != 1)
+            paranoid = 2;
+        fclose(file);
+    }
+    for (size_t i = 0; i < PERF_COUNTERS; i++)
+    {
+        struct perf_event_attr attr = {
+            .type = perf_counters[i].type,
+            .size = sizeof(struct perf_event_attr),
+            .config = perf_counters[i].config,
+            .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+            .disabled = execs,
+            .enable_on_exec = execs,
+            .inherit = 1,
+            .exclude_kernel = paranoid >= 2 && geteuid() != 0, // Unprivileged users may only count user space.
+            .exclude_hv = paranoid >= 2 && geteuid() != 0,
+        };
+        perf->fds[i] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (perf->fds[i] == -1)
+            perf->errors[i] = errno;
+    }
+}
+
+/**
+ * Reads the final values of a finished stage's counters and closes them. Counters the kernel had to
+ * multiplex with other events are scaled up to the whole run.
+ */
+static void read_perf_counters(struct perf_stage *perf)
+{
+    for (size_t i = 0; i < PERF_COUNTERS; i++)
+    {
+        if (perf->fds[i] == -1)
+            continue;
+        uint64_t values[3]; // Value, time enabled, time running.
+        if (read(perf->fds[i], values, sizeof(values)) == sizeof(values))
+        {
+            perf->counts[i] = values[0];
+            if (values[2] > 0 && values[2] < values[1])
+                perf->counts[i] *= (double)values[1] / values[2];
+        }
+        else
+        {
+            perf->errors[i] = errno;
+        }
+        close(perf->fds[i]);
+        perf->fds[i] = -1;
+    }
+}
+
+/**
+ * Prints the counters of every stage of a finished perfstat job, one line per stage, and why
+ * counters that could not be opened are missing.
+ */
+static void report_perf_counters(const struct job *job)
+{
+    const struct perf_stage *failed = NULL; // A stage whose counters could not all be opened.
+    for (size_t idx = 0; idx < job->num_stages; idx++)
+    {
+        const struct perf_stage *perf = &job->perf[idx];
+        const struct stage *stage = &job->stages[idx];
+        if (stage->pid <= 0)
+            continue;
+        fprintf(stderr, "perfstat [%zu] %s:", idx + 1, stage->argc > 0 ? stage->argv[0] : "");
+        for (size_t i = 0; i < PERF_COUNTERS; i++)
+        {
+            if (perf->errors[i])
+                failed = perf;
+            else if (i == PERF_TASK_CLOCK)
+                fprintf(stderr, " %.2fms %s", perf->counts[i] / 1e6, perf_counters[i].name);
+            else
+                fprintf(stderr, " %.0f %s", perf->counts[i], perf_counters[i].name);
+        }
+        if (!perf->errors[PERF_CYCLES] && !perf->errors[PERF_INSTRUCTIONS] && perf->counts[PERF_CYCLES] > 0)
+            fprintf(stderr, " (%.2f IPC)", perf->counts[PERF_INSTRUCTIONS] / perf->counts[PERF_CYCLES]);
+        fputc('\n', stderr);
+    }
+    if (!failed)
+        return;
+    int error = 0;
+    fprintf(stderr, "perfstat:");
+    for (size_t i = 0; i < PERF_COUNTERS; i++)
+    {
+        if (failed->errors[i])
+        {
+            fprintf(stderr, "%s %s", error ? "," : "", perf_counters[i].name);
+            error = failed->errors[i];
+        }
+    }
+    fprintf(stderr, " not counted: %s\n", strerror(error));
+}
+
+/**
+ * Placeholder for perfstat found anywhere but at the start of a command line, where execute_cmd
+ * consumes it.
+ */
+static int builtin_perfstat(size_t argc, char *argv[])
+{
+    fprintf(stderr, "perfstat: must come first on the command line\n");
+    return 2;
+}
+
+/**
+ * Joins the words of a command back into a single line for job listings.
+ *
+ * @param num_args Number of arguments in args.
+ * @param args Array of arguments.
+ * @return A newly allocated string.
+ */
+static char *join_args(size_t num_args, char *args[])
+{
+    struct strbuf line = {0};
+    strbuf_append(&line, "", 0);
+    for (size_t i = 0; i < num_args; i++)
+    {
+        if (i > 0)
+            strbuf_append(&line, " ", 1);
+        strbuf_append(&line, args[i], strlen(args[i]));
+    }
+    return line.data;
+}
+
+/**
+ * Allocates a job for the given stages.
+ *
+ * @param cmdline The command as typed, owned by the job from now on.
+ * @param stages The stages, owned by the job from now on.
+ * @param num_stages The number of stages.
+ * @param cwd The directory the job runs in, for the audit log, or NULL for the shell's.
+ * @return The job, not yet started.
+ */
+static struct job *create_job(char *cmdline, struct stage *stages, size_t num_stages, const char *cwd)
+{
+    struct job *job = calloc(1, sizeof(struct job));
+    if (!job)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    char buf[PATH_MAX];
+    if (!cwd)
+        cwd = getcwd(buf, sizeof(buf)) ? buf : "";
+    job->cmdline = cmdline;
+    job->cwd = strdup(cwd);
+    clock_gettime(CLOCK_REALTIME, &job->submitted);
+    job->stages = stages;
+    job->num_stages = num_stages;
+    for (size_t i = 0; i < 3; i++)
+        job->fds[i] = -1;
+    return job;
+}
+
+/**
+ * Executes a parsed command line. Its words are split into pipeline stages, each with its own input
+ * and output redirection. A builtin that is not part of a pipeline (such as 'cd') runs inside the
+ * shell; everything else is executed by execute_pipe, in the background if the command ends with '&'.
+ *
+ * @param line The line's parse cache entry.
+ */
+static void execute_cmd(struct parse_entry *line)
+{
+    size_t num_args = line->num_words;
+    char **args = line->words;
+    if (num_args == 0)
+        return;
+
+    // A leading 'perfstat' counts hardware events of the stages of the rest of the line.
+    bool perfstat = strcmp(args[0], "perfstat") == 0;
+    args += perfstat;
+    num_args -= perfstat;
+    if (perfstat && (num_args == 0 || strcmp(args[0], "&") == 0))
+    {
+        fprintf(stderr, "usage: perfstat command\n");
+        last_status = 2;
+        return;
+    }
+
+    bool background = strcmp(args[num_args - 1], "&") == 0;
+    if (background && num_args == 1)
+    {
+        fprintf(stderr, "Syntax error near unexpected token `&'\n");
+        last_status = 2;
+        return;
+    }
+    size_t num_words = num_args - background;
+
+    // A command made only of NAME=value words sets shell variables.
+    size_t num_assignments = 0;
+    while (num_assignments < num_words && assignment_name_len(args[num_assignments]) > 0)
+        num_assignments++;
+    if (num_assignments == num_words && !background)
+    {
+        for (size_t i = 0; i < num_assignments; i++)
+        {
+            size_t name_len = assignment_name_len(args[i]);
+            char *name = strndup(args[i], name_len);
+            char *value = expand_word(args[i] + name_len + 1);
+            set_var(name, value);
+            free(name);
+            free(value);
+        }
+        last_status = 0;
+        return;
+    }
+
+    size_t num_stages;
+    struct stage *stages = line_stages(line, num_words, args, &num_stages);
+    if (!stages)
+    {
+        last_status = 2;
+        return;
+    }
+
+    if (stages[0].argc > 0)
+        learn_command(stages[0].argv[0]);
+    const struct builtin *builtin = stages[0].argc > 0 ? find_builtin(stages[0].argv[0]) : NULL;
+    if (!background && num_stages == 1 && stages[0].argc == 0)
+    {
+        stages[0].status = 0; // Only redirections, nothing to run.
+        record_pipeline_status(stages, num_stages);
+        free_stages(stages, num_stages);
+        return;
+    }
+    if (!background && num_stages == 1 && builtin)
+    {
+        struct timespec submitted, started, finished;
+        char cwd[PATH_MAX] = "";
+        clock_gettime(CLOCK_REALTIME, &submitted);
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        if (audit.enabled && !getcwd(cwd, sizeof(cwd)))
+            cwd[0] = '\0';
+        stages[0].status = run_builtin(builtin, &stages[0]);
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        record_pipeline_status(stages, num_stages);
+        char *cmdline = join_args(num_words, args);
+        finish_command(cmdline, stages, num_stages, cwd, submitted, started, finished, last_status);
+        free(cmdline);
+        free_stages(stages, num_stages);
+        return;
+    }
+
+    struct job *job = create_job(join_args(num_words, args), stages, num_stages, NULL);
+    job->background = background;
+    if (perfstat)
+    {
+        job->perf = calloc(num_stages, sizeof(struct perf_stage));
+        if (!job->perf)
+        {
+            perror("calloc failed");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t idx = 0; idx < num_stages; idx++)
+        {
+            for (size_t i = 0; i < PERF_COUNTERS; i++)
+                job->perf[idx].fds[i] = -1;
+        }
+    }
+    execute_pipe(job);
+}
+
+/**
+ * Splits a command line into words separated by spaces.
+ *
+ * @param input The command line, modified by strtok.
+ * @param num_words Set to the number of words.
+ * @return A newly allocated NULL terminated array of newly allocated words.
+ */
+static char **split_words(char *input, size_t *num_words)
+{
+    char **args = NULL;
+    size_t num_args = 0, capacity = 10;
+    args = malloc(capacity * sizeof(char *));
+    if (!args)
+    {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    char *token = strtok(input, " \n");
+    while (token != NULL)
+    {
+        if (num_args + 1 >= capacity) // Reallocate memory if capacity is exceeded.
+        {
+            capacity *= 2;
+            args = realloc(args, capacity * sizeof(char *));
+            if (!args)
+            {
+                perror("realloc failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        args[num_args++] = strdup(token); // Store the token and increase the count.
+        token = strtok(NULL, " \n");
+    }
+    args[num_args] = NULL; // Null terminate the list of arguments.
+    *num_words = num_args;
+    return args;
+}
+
+/**
+ * Replaces the command word of every pipeline stage that names an alias with the alias's words. The
+ * replacement is not expanded again, so an alias may use its own name (alias ls=ls -F).
+ *
+ * @param args The words of a command line, replaced by a new array.
+ * @param num_args Number of words, updated.
+ */
+static void expand_aliases(char ***args, size_t *num_args)
+{
+    if (!alias_table || *num_args == 0)
+        return;
+    char **words = NULL;
+    size_t num_words = 0;
+    bool command_word = true; // The word starts a pipeline stage.
+    for (size_t i = 0; i < *num_args; i++)
+    {
+        char *word = (*args)[i];
+        const char *value = command_word ? find_alias(word) : NULL;
+        command_word = strcmp(word, "|") == 0;
+        if (!value)
+        {
+            push_string(&words, &num_words, word);
+            continue;
+        }
+        char *copy = strdup(value);
+        size_t num_alias_words;
+        char **alias_words = split_words(copy, &num_alias_words);
+        for (size_t j = 0; j < num_alias_words; j++)
+            push_string(&words, &num_words, alias_words[j]);
+        free(alias_words);
+        free(copy);
+        free(word);
+    }
+    free(*args);
+    *args = words;
+    *num_args = num_words;
+}
+
+static void free_parse_entry(struct parse_entry *entry)
+{
+    for (size_t i = 0; i < entry->num_words; i++)
+        free(entry->words[i]);
+    free(entry->words);
+    if (entry->stages)
+        free_stages(entry->stages, entry->num_stages);
+    free(entry->line);
+    free(entry);
+}
+
+/**
+ * Unlinks a cache entry from the recency list.
+ */
+static void unlink_parse_entry(struct parse_entry *entry)
+{
+    *(entry->newer ? &entry->newer->older : &parse_cache.newest) = entry->older;
+    *(entry->older ? &entry->older->newer : &parse_cache.oldest) = entry->newer;
+}
+
+/**
+ * Removes an entry from the cache. It is freed right away unless a run of its line is still in
+ * progress (a line whose builtin defines an alias clears the cache while it runs), in which case
+ * release_parse_entry frees it.
+ */
+static void drop_parse_entry(struct parse_entry *entry)
+{
+    unlink_parse_entry(entry);
+    struct parse_entry **link = &parse_cache.buckets[entry->hash % PARSE_CACHE_BUCKETS];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+    parse_cache.len--;
+    entry->dropped = true;
+    if (entry->uses == 0)
+        free_parse_entry(entry);
+}
+
+/**
+ * Forgets every cached parse, as needed whenever the words a line splits into could change.
+ */
+static void clear_parse_cache(void)
+{
+    while (parse_cache.newest)
+        drop_parse_entry(parse_cache.newest);
+}
+
+/**
+ * Splits a command line into words, with aliases expanded if asked, through an LRU cache of the lines
+ * seen last: monitoring loops and retries send the same lines over and over. Lines longer than
+ * PARSE_CACHE_LINE_MAX are parsed for this run only.
+ *
+ * @param line The command line.
+ * @param aliases Whether to expand aliases (interactive lines) or not (machine-mode requests).
+ * @return The line's entry, to be given back to release_parse_entry when the run is over.
+ */
+static struct parse_entry *acquire_parse_entry(const char *line, bool aliases)
+{
+    size_t line_len = strlen(line);
+    uint64_t hash = line_len <= PARSE_CACHE_LINE_MAX ? hash_string(line) ^ aliases : 0;
+    struct parse_entry **bucket = &parse_cache.buckets[hash % PARSE_CACHE_BUCKETS];
+    struct parse_entry *entry = line_len <= PARSE_CACHE_LINE_MAX ? *bucket : NULL;
+    while (entry && (entry->hash != hash || entry->aliases != aliases || strcmp(entry->line, line) != 0))
+        entry = entry->next;
+    if (entry)
+    {
+        parse_cache.hits++;
+        unlink_parse_entry(entry);
+    }
+    else
+    {
+        parse_cache.misses++;
+        entry = calloc(1, sizeof(struct parse_entry));
+        if (!entry)
+        {
+            perror("calloc failed");
+            exit(EXIT_FAILURE);
+        }
+        char *input = strdup(line);
+        entry->words = split_words(input, &entry->num_words);
+        free(input);
+        if (aliases)
+            expand_aliases(&entry->words, &entry->num_words);
+        entry->aliases = aliases;
+        if (line_len > PARSE_CACHE_LINE_MAX)
+        {
+            entry->uses = 1;
+            entry->dropped = true;
+            return entry;
+        }
+        entry->hash = hash;
+        entry->line = strdup(line);
+        entry->next = *bucket;
+        *bucket = entry;
+        if (++parse_cache.len > PARSE_CACHE_SIZE)
+            drop_parse_entry(parse_cache.oldest);
+    }
+    entry->uses++;
+    entry->older = parse_cache.newest;
+    entry->newer = NULL;
+    *(parse_cache.newest ? &parse_cache.newest->newer : &parse_cache.oldest) = entry;
+    parse_cache.newest = entry;
+    return entry;
+}
+
+/**
+ * Ends a run of a line returned by acquire_parse_entry, freeing the entry if it has left the cache.
+ */
+static void release_parse_entry(struct parse_entry *entry)
+{
+    if (--entry->uses == 0 && entry->dropped)
+        free_parse_entry(entry);
+}
+
+/**
+ * Makes the stages of a run of a parsed line, parsing its stage templates the first time they are
+ * needed. A line with a syntax error keeps none, so that every run reports the error.
+ *
+ * @param line The line's parse cache entry.
+ * @param num_args Number of the line's words making up the pipeline.
+ * @param args The first of them.
+ * @param num_stages Set to the number of stages.
+ * @return The stages of the run, or NULL on a syntax error (an error has been printed).
+ */
+static struct stage *line_stages(struct parse_entry *line, size_t num_args, char *args[], size_t *num_stages)
+{
+    if (!line->stages)
+        line->stages = parse_stages(num_args, args, &line->num_stages);
+    if (!line->stages)
+        return NULL;
+    *num_stages = line->num_stages;
+    return expand_stages(line->stages, line->num_stages);
+}
+
+/**
+ * Parses the command line input into tokens that are executed by execute_cmd.
+ *
+ * @param input The command line input string.
+ */
+static void parse_cmd(char *input)
+{
+    struct parse_entry *line = acquire_parse_entry(input, true);
+    execute_cmd(line);
+    release_parse_entry(line);
+}
+
+/**
+ * Displays a help message listing built-in commands and supported features.
+ */
+static void execute_help(void)
+{
+    printf("Help:\n"
+           "Type program names and arguments, and hit enter.\n"
+           "The following are built-in:\n");
+    for (size_t i = 0; i < sizeof(builtin_table) / sizeof(builtin_table[0]); i++)
+    {
+        printf("  * %s\n", builtin_table[i].usage);
+    }
+    for (struct loaded_builtin *loaded = loaded_builtins; loaded; loaded = loaded->next)
+    {
+        printf("  * %s (loaded from %s)\n", loaded->builtin.usage, loaded->path);
+    }
+    printf("  * help - display this help message\n"
+           "  * quit - exit the shell\n"
+           "Supported features: piping (|), redirection (<, >), background jobs (&), variables (NAME=value,\n"
+           "$NAME, $? and ${PIPESTATUS[@]}); PIPESIZE=size[,size...] sets pipe capacities; REPORTTIME=span\n"
+           "reports the resource usage of commands that run at least that long; ~/.shellrc (or $SHELLRC) is\n"
+           "loaded at startup; PS1 sets the prompt, with \\w (directory), \\W (its last component), \\u (user),\n"
+           "\\h (host), \\? (last status), \\j (jobs), \\t (time), \\g (git branch), \\$, \\n and \\nnn (octal)\n");
+}
+
+/**
+ * Finds the index of the pipe symbol ('|') in the command arguments, which indicates that
+ * the command should be split into two subprocesses with the output of the first connected to
+ * the input of the second.
+ *
+ * @param num_args The number of arguments in the args array.
+ * @param args The array of arguments.
+ * @return The index of the pipe symbol if found, or -1 if not found.
+ */
+static int find_pipe_idx(const size_t num_args, char *args[])
+{
+    for (size_t i = 0; i < num_args; i++)
+    {
+        if (strcmp(args[i], "|") == 0)
+        {
+            return (int)i; // Return the index of the pipe symbol.
+        }
+    }
+    return -1; // Return -1 if no pipe symbol is found.
+}
+
+/**
+ * Starts a ratelimit stage of a pipeline inside the shell. The limiter takes over the descriptors
+ * connecting it to its neighbours, or opens its own for the ends of the pipeline.
+ *
+ * @param job The job.
+ * @param idx The index of the ratelimit stage.
+ * @param in_fd Read end of the pipe from the previous stage, or -1 for the first stage.
+ * @param out_fd Write end of the pipe to the next stage, or -1 for the last stage.
+ * @param relay_fd Write end of the job's stdout relay, or -1.
+ * @return true if the stage is running, false if it failed (its status has been set).
+ */
+static bool start_limiter_stage(struct job *job, size_t idx, int in_fd, int out_fd, int relay_fd)
+{
+    struct stage *stage = &job->stages[idx];
+    if (stage->input_file)
+    {
+        if (in_fd != -1)
+            close(in_fd);
+        if ((in_fd = open(stage->input_file, O_RDONLY | O_CLOEXEC)) == -1)
+            perror("Failed to redirect input");
+    }
+    else if (in_fd == -1)
+    {
+        if (job->fds[0] != -1)
+            in_fd = fcntl(job->fds[0], F_DUPFD_CLOEXEC, 0);
+        else
+            in_fd = job->background ? open("/dev/null", O_RDONLY | O_CLOEXEC) : dup(STDIN_FILENO);
+    }
+    if (stage->output_file)
+    {
+        if (out_fd != -1)
+            close(out_fd);
+        if ((out_fd = open(stage->output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1)
+            perror("Failed to redirect output");
+    }
+    else if (out_fd == -1)
+    {
+        out_fd = fcntl(relay_fd != -1 ? relay_fd : job->fds[1] != -1 ? job->fds[1] : STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    }
+    if (in_fd == -1 || out_fd == -1)
+    {
+        if (in_fd != -1)
+            close(in_fd);
+        if (out_fd != -1)
+            close(out_fd);
+        stage->status = EXIT_FAILURE;
+        stage->finished = true;
+        return false;
+    }
+
+    stats.spawns_shell++;
+    stage->limiter = create_rate_limiter(stage->argc, stage->argv, in_fd, out_fd);
+    if (!stage->limiter)
+    {
+        stage->status = 2;
+        stage->finished = true;
+        return false;
+    }
+    stage->limiter->job = job;
+    stage->limiter->stage = stage;
+    return true;
+}
+
+/**
+ * Executes a job's pipeline of any number of stages. Each stage's output is connected to the next
+ * stage's input through a pipe, and every stage is forked before any of them is waited for. Each
+ * pipe gets the capacity asked for by PIPESIZE. A foreground job is waited for and its stage statuses
+ * end up in PIPESTATUS; a background job is added to the job table, with its input taken from
+ * /dev/null and, with linebuf set, its output relayed through the shell. A ratelimit stage is not
+ * forked but runs inside the shell, driven by the event loop. A job submitted in machine mode runs
+ * like a background job, in its requested directory and environment, with its output captured. If a
+ * fork fails, the stages already started still run and the remaining ones are marked as failed.
+ *
+ * @param job The job to run. Foreground jobs are freed once they finish.
+ */
+static void execute_pipe(struct job *job)
+{
+    struct stage *stages = job->stages;
+    size_t num_stages = job->num_stages;
+    job->edges = calloc(num_stages, sizeof(struct pipe_edge));
+    if (!job->edges)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    int relay_fds[2] = {-1, -1}; // Write ends of the stdout and stderr relays.
+    if (job->request)
+    {
+        job->relays[0] = create_relay(job, -1, &relay_fds[0]);
+        job->relays[1] = create_relay(job, -1, &relay_fds[1]);
+    }
+    else if (job->background && options.linebuf && !job->on_finish)
+    {
+        job->relays[0] = create_relay(job, STDOUT_FILENO, &relay_fds[0]);
+        job->relays[1] = create_relay(job, STDERR_FILENO, &relay_fds[1]);
+    }
+    int prev_read = -1; // Read end of the pipe feeding the current stage.
+    for (size_t i = 0; i < num_stages; i++)
+    {
+        int fd[2] = {-1, -1};
+        if (i + 1 < num_stages)
+        {
+            if (pipe(fd) == -1)
+            {
+                perror("pipe");
+                break;
+            }
+            long size = requested_pipe_size(i);
+            if (size > 0 && fcntl(fd[1], F_SETPIPE_SZ, (int)size) == -1)
+                perror("PIPESIZE");
+            job->edges[i].capacity = fcntl(fd[1], F_GETPIPE_SZ);
+        }
+        if (stages[i].argc > 0 && strcmp(stages[i].argv[0], "ratelimit") == 0)
+        {
+            if (start_limiter_stage(job, i, prev_read, fd[1], relay_fds[0]))
+            {
+                job->running++;
+                stages[i].pid = 0; // Runs inside the shell.
+            }
+            prev_read = fd[0];
+            continue;
+        }
+        if (stages[i].argc > 0 && !find_builtin(stages[i].argv[0]) && !overrides_path(job->request))
+        {
+            const char *path = resolve_command(stages[i].argv[0]);
+            stages[i].path = path ? strdup(path) : NULL;
+        }
+        int status_pipe[2] = {-1, -1}; // Tells the shell when the stage has exec'd.
+        if (stages[i].argc > 0 && !find_builtin(stages[i].argv[0]) && pipe2(status_pipe, O_CLOEXEC) == -1)
+            status_pipe[0] = status_pipe[1] = -1;
+        int go_pipe[2] = {-1, -1}; // Holds the stage back until its perfstat counters are open.
+        if (job->perf && pipe2(go_pipe, O_CLOEXEC) == -1)
+            go_pipe[0] = go_pipe[1] = -1;
+        fflush(stdout);
+        struct timespec fork_start;
+        clock_gettime(CLOCK_MONOTONIC, &fork_start);
+        pid_t pid = fork();
+        if (pid > 0)
+            record_spawn(fork_start);
+        if (pid == 0) // Child process: connect the neighbouring pipes and run the stage.
+        {
+            signal(SIGPIPE, SIG_DFL); // The shell ignores SIGPIPE, programs should not.
+            if (job->request)
+            {
+                setpgid(0, job->request->pgid); // Also done by the parent, whichever runs first.
+                if (!apply_request(job->request))
+                    exit_before_exec(status_pipe[1], 126);
+            }
+            if (prev_read != -1)
+            {
+                dup2(prev_read, STDIN_FILENO); // Read from the previous stage.
+                close(prev_read);
+            }
+            else if (job->fds[0] != -1)
+            {
+                dup2(job->fds[0], STDIN_FILENO);
+            }
+            else if (job->background)
+            {
+                redirect_fd("/dev/null", O_RDONLY, STDIN_FILENO); // Keep background jobs off the terminal.
+            }
+            if (fd[1] != -1)
+            {
+                close(fd[0]);               // Close the read end of the pipe.
+                dup2(fd[1], STDOUT_FILENO); // Redirect stdout to the write end of the pipe.
+                close(fd[1]);               // Close the original write end.
+            }
+            else if (relay_fds[0] != -1)
+            {
+                dup2(relay_fds[0], STDOUT_FILENO); // The last stage writes to the shell's relay.
+            }
+            else if (job->fds[1] != -1)
+            {
+                dup2(job->fds[1], STDOUT_FILENO);
+            }
+            if (relay_fds[1] != -1)
+                dup2(relay_fds[1], STDERR_FILENO);
+            else if (job->fds[2] != -1)
+                dup2(job->fds[2], STDERR_FILENO);
+            if (go_pipe[0] != -1)
+            {
+                char go;
+                close(go_pipe[1]);
+                while (read(go_pipe[0], &go, 1) == -1 && errno == EINTR)
+                    ;
+            }
+            exec_stage(&stages[i], status_pipe[1]);
+        }
+        if (go_pipe[0] != -1)
+        {
+            if (pid > 0)
+            {
+                open_perf_counters(&job->perf[i], pid, status_pipe[0] != -1);
+                write_all(go_pipe[1], "", 1);
+            }
+            close(go_pipe[0]);
+            close(go_pipe[1]);
+        }
+        if (status_pipe[1] != -1)
+            close(status_pipe[1]);
+        if (pid < 0)
+        {
+            if (status_pipe[0] != -1)
+                close(status_pipe[0]);
+            stats.spawn_failures++;
+            perror("fork");
+            if (fd[0] != -1)
+            {
+                close(fd[0]);
+                close(fd[1]);
+            }
+            break;
+        }
+
+        // Parent process: the pipe ends now belong to the children.
+        stages[i].pid = pid;
+        if (job->request)
+        {
+            if (!job->request->pgid)
+                job->request->pgid = pid;
+            setpgid(pid, job->request->pgid);
+        }
+        stages[i].pidfd = syscall(SYS_pidfd_open, pid, 0); // Lets the event loop see the stage exit.
+        job->running++;
+        if (status_pipe[0] != -1)
+        {
+            stages[i].exec_fd = status_pipe[0];
+            stages[i].forked = fork_start;
+            ev_add(stages[i].exec_fd, POLLIN, exec_status_event, job);
+        }
+        if (prev_read != -1)
+            close(prev_read);
+        if (fd[1] != -1)
+            close(fd[1]);
+        prev_read = fd[0];
+    }
+    if (prev_read != -1)
+        close(prev_read);
+    for (size_t i = 0; i < 2; i++)
+    {
+        if (relay_fds[i] != -1)
+            close(relay_fds[i]); // Only the stages hold the relays open now, so EOF means they are done.
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    if (job->running == 0)
+        job->finished = job->started; // Nothing was started.
+    if (options.adaptpipe && num_stages > 1)
+        start_adapt_timer();
+    for (size_t i = 0; i < num_stages; i++)
+    {
+        if (stages[i].pid == -1 && !stages[i].finished)
+        {
+            stages[i].status = EXIT_FAILURE; // Never started because a pipe or fork failed.
+            stages[i].finished = true;
+        }
+    }
+
+    if (job->background || job->on_finish)
+    {
+        add_job(job);
+        if (!job->on_finish)
+            printf("[%d] %d\n", job->id, (int)stages[num_stages - 1].pid);
+        return;
+    }
+    foreground_job = job;
+    wait_job(job);
+    foreground_job = NULL;
+    if (options.adaptpipe)
+        report_pipe_sizes(job);
+    if (job->perf)
+        report_perf_counters(job);
+    record_pipeline_status(stages, num_stages);
+    finish_command(job->cmdline, stages, num_stages, job->cwd, job->submitted, job->started, job->finished,
+                   last_status);
+    free_job(job);
+}
+
+/**
+ * Event loop callback for standard input while the shell waits at the prompt: appends whatever is
+ * available to the line reader.
+ */
+static void read_input(int fd, short revents, void *data)
+{
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n > 0)
+        strbuf_append(&stdin_reader.buf, buf, n);
+    else if (n == 0 || (errno != EINTR && errno != EAGAIN))
+        stdin_reader.eof = true;
+}
+
+/**
+ * Takes the next complete line, newline included, from the line reader. At the end of the input a
+ * last line without a newline is returned as well.
+ *
+ * @return A newly allocated line, or NULL if no complete line has been read yet.
+ */
+static char *next_line(void)
+{
+    struct strbuf *buf = &stdin_reader.buf;
+    char *newline = buf->len ? memchr(buf->data, '\n', buf->len) : NULL;
+    size_t len;
+    if (newline)
+        len = newline - buf->data + 1;
+    else if (stdin_reader.eof && buf->len > 0)
+        len = buf->len;
+    else
+        return NULL;
+    char *line = strndup(buf->data, len);
+    memmove(buf->data, buf->data + len, buf->len - len + 1);
+    buf->len -= len;
+    return line;
+}
+
+/**
+ * Waits for the next command line, running the event loop (and with it background job bookkeeping)
+ * while the user types. Standard input is only watched here, so that commands run by the shell can
+ * read it themselves.
+ *
+ * @return A newly allocated line, or NULL at the end of the input.
+ */
+static char *read_command_line(void)
+{
+    char *line;
+    ev_add(STDIN_FILENO, POLLIN, read_input, NULL);
+    while (!(line = next_line()) && !stdin_reader.eof)
+        ev_wait(-1);
+    ev_remove(STDIN_FILENO);
+    return line;
+}
+
+/**
+ * Finds the rc file: $SHELLRC, else ~/.shellrc.
+ *
+ * @return The path in buf, or NULL if there is no home directory to look in.
+ */
+static const char *rc_path(char *buf, size_t size)
+{
+    const char *rc = getenv("SHELLRC");
+    if (rc)
+        return rc;
+    const char *home = getenv("HOME");
+    if (!home)
+        return NULL;
+    snprintf(buf, size, "%s/.shellrc", home);
+    return buf;
+}
+
+/**
+ * Adds an environment variable and its value to a hash of variables, as kept in env_reads.
+ */
+static uint64_t hash_env_var(uint64_t hash, const char *name, const char *value)
+{
+    return (hash * 31) ^ hash_string(name) ^ (value ? hash_string(value) * 31 : 0);
+}
+
+/**
+ * Notes that the rc file read an environment variable, the first time it does.
+ *
+ * @param name The variable.
+ * @param value Its value, or NULL if it is not set.
+ */
+static void note_env_read(const char *name, const char *value)
+{
+    for (size_t i = 0; i < env_reads.len; i++)
+    {
+        if (strcmp(env_reads.names[i], name) == 0)
+            return;
+    }
+    push_string(&env_reads.names, &env_reads.len, strdup(name));
+    env_reads.hash = hash_env_var(env_reads.hash, name, value);
+}
+
+/**
+ * Fills in the header a snapshot of the state loaded from an rc file must have to be used: the
+ * format version and the identity of the rc file. The hash of the environment variables it read is
+ * only known once it has been loaded, and is left 0 like the size.
+ */
+static void snapshot_header(struct snapshot_header *header, const struct stat *rc)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->rc_dev = rc->st_dev;
+    header->rc_ino = rc->st_ino;
+    header->rc_size = rc->st_size;
+    header->rc_mtime_ns = rc->st_mtim.tv_sec * 1000000000LL + rc->st_mtim.tv_nsec;
+}
+
+/**
+ * Appends one record to a snapshot: its kind, then two length-prefixed strings.
+ */
+static void snapshot_record(struct strbuf *out, uint8_t kind, const char *first, const char *second)
+{
+    uint32_t lens[2] = {strlen(first), strlen(second)};
+    strbuf_append(out, (const char *)&kind, 1);
+    strbuf_append(out, (const char *)lens, sizeof(lens));
+    strbuf_append(out, first, lens[0]);
+    strbuf_append(out, second, lens[1]);
+}
+
+/**
+ * Appends a list of variables or aliases to a snapshot, last first, so that restoring them one by one
+ * rebuilds the list in the same order.
+ */
+static void snapshot_list(struct strbuf *out, uint8_t kind, const struct shell_var *list)
+{
+    if (!list)
+        return;
+    snapshot_list(out, kind, list->next);
+    snapshot_record(out, kind, list->name, list->value);
+}
+
+/**
+ * Writes the state the rc file set up (variables, aliases, options, the PATH cache and the working
+ * directory) and the environment variables it read to the snapshot, replacing it atomically.
+ *
+ * @param path The snapshot file.
+ * @param header The header identifying the rc file and the environment it was loaded in.
+ * @param start_cwd The working directory before the rc file was loaded, which is only recorded if the
+ *                  rc file changed it: later shells start wherever they are started.
+ */
+static void save_snapshot(const char *path, const struct snapshot_header *header, const char *start_cwd)
+{
+    struct strbuf out = {0};
+    strbuf_append(&out, (const char *)header, sizeof(*header));
+    snapshot_list(&out, SNAPSHOT_VAR, var_table);
+    snapshot_list(&out, SNAPSHOT_ALIAS, alias_table);
+    for (size_t i = 0; i < env_reads.len; i++)
+        snapshot_record(&out, SNAPSHOT_ENV, env_reads.names[i], "");
+    for (size_t i = 0; i < sizeof(option_table) / sizeof(option_table[0]); i++)
+        snapshot_record(&out, SNAPSHOT_OPTION, option_table[i].name, *option_table[i].flag ? "1" : "");
+    if (path_cache.path_var)
+    {
+        snapshot_record(&out, SNAPSHOT_PATH_VAR, path_cache.path_var, "");
+        for (size_t i = 0; i < PATH_CACHE_BUCKETS; i++)
+        {
+            for (struct path_entry *entry = path_cache.buckets[i]; entry; entry = entry->next)
+                snapshot_record(&out, SNAPSHOT_PATH_ENTRY, entry->name, entry->path);
+        }
+    }
+    char *cwd = getcwd(NULL, 0);
+    const char *previous = dir_stack.previous.fd != -1 ? dir_stack.previous.path : "";
+    if (cwd && start_cwd)
+    {
+        const char *moved_to = strcmp(cwd, start_cwd) != 0 ? cwd : "";
+        const char *back_to = strcmp(previous, start_cwd) != 0 ? previous : "";
+        if (*moved_to || *back_to)
+            snapshot_record(&out, SNAPSHOT_CWD, moved_to, back_to);
+    }
+    free(cwd);
+    ((struct snapshot_header *)out.data)->size = out.len;
+
+    // A unique temporary file, since shells starting at the same time may all be saving a snapshot.
+    char tmp[PATH_MAX + 8];
+    int fd = -1;
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) < (int)sizeof(tmp))
+        fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd != -1 && (!write_all(fd, out.data, out.len) || close(fd) == -1 || rename(tmp, path) == -1))
+        unlink(tmp); // A shell that cannot write its snapshot just reads the rc file again next time.
+    free(out.data);
+}
+
+/**
+ * Repeats the directory changes of the rc file recorded in a snapshot.
+ *
+ * @param cwd The working directory it left, or "" for the one the shell started in.
+ * @param previous Where it left cd - going, or "" for the directory the shell started in.
+ */
+static void restore_dirs(const char *cwd, const char *previous)
+{
+    if (!*previous)
+    {
+        change_dir(cwd, "cd");
+        return;
+    }
+    char *start = getcwd(NULL, 0);
+    if (start && change_dir(previous, "cd"))
+        change_dir(*cwd ? cwd : start, "cd"); // cd - now goes to previous.
+    free(start);
+}
+
+/**
+ * Walks the records of a mapped snapshot, checking that they are well formed and, when apply is set,
+ * restoring the state they hold.
+ *
+ * @param env_hash Unless apply is set, receives the hash of the current values of the environment
+ *                 variables the snapshot depends on, to compare with its header's.
+ * @return false if the snapshot is corrupt.
+ */
+static bool walk_snapshot(const char *data, size_t size, bool apply, uint64_t *env_hash)
+{
+    size_t pos = sizeof(struct snapshot_header);
+    while (pos < size)
+    {
+        uint32_t lens[2];
+        if (size - pos < 1 + sizeof(lens))
+            return false;
+        uint8_t kind = data[pos];
+        memcpy(lens, data + pos + 1, sizeof(lens));
+        pos += 1 + sizeof(lens);
+        if (lens[0] > size - pos || lens[1] > size - pos - lens[0])
+            return false;
+        if (!apply && kind == SNAPSHOT_ENV)
+        {
+            char *name = strndup(data + pos, lens[0]);
+            *env_hash = hash_env_var(*env_hash, name, getenv(name));
+            free(name);
+        }
+        if (apply)
+        {
+            char *first = strndup(data + pos, lens[0]);
+            char *second = strndup(data + pos + lens[0], lens[1]);
+            if (kind == SNAPSHOT_VAR)
+                set_var(first, second);
+            else if (kind == SNAPSHOT_ALIAS)
+                set_alias(first, second);
+            else if (kind == SNAPSHOT_CWD)
+                restore_dirs(first, second);
+            const size_t num_options = sizeof(option_table) / sizeof(option_table[0]);
+            for (size_t i = 0; kind == SNAPSHOT_OPTION && i < num_options; i++)
+            {
+                if (strcmp(option_table[i].name, first) == 0)
+                    *option_table[i].flag = *second != '\0';
+            }
+            if (kind == SNAPSHOT_PATH_VAR)
+            {
+                clear_path_cache();
+                path_cache.path_var = strdup(first);
+            }
+            else if (kind == SNAPSHOT_PATH_ENTRY)
+            {
+                struct path_entry *entry = malloc(sizeof(struct path_entry));
+                if (!entry)
+                {
+                    perror("malloc failed");
+                    exit(EXIT_FAILURE);
+                }
+                struct path_entry **bucket = &path_cache.buckets[hash_string(first) % PATH_CACHE_BUCKETS];
+                entry->name = strdup(first);
+                entry->path = strdup(second);
+                entry->next = *bucket;
+                *bucket = entry;
+            }
+            free(first);
+            free(second);
+        }
+        pos += lens[0] + lens[1];
+    }
+    return true;
+}
+
+/**
+ * Restores the state of a snapshot taken after the rc file was last loaded, if the rc file and the
+ * environment variables it read are unchanged since.
+ *
+ * @param path The snapshot file.
+ * @param expected The header the snapshot must have.
+ * @return false if there is no usable snapshot and the rc file has to be loaded.
+ */
+static bool restore_snapshot(const char *path, const struct snapshot_header *expected)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct snapshot_header))
+    {
+        close(fd);
+        return false;
+    }
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    struct snapshot_header header;
+    memcpy(&header, data, sizeof(header));
+    uint64_t saved_env_hash = header.env_hash, env_hash = 0;
+    bool usable = header.size == (uint64_t)st.st_size;
+    header.size = 0;
+    header.env_hash = 0;
+    usable = usable && memcmp(&header, expected, sizeof(header)) == 0 &&
+             walk_snapshot(data, st.st_size, false, &env_hash) && env_hash == saved_env_hash;
+    if (usable)
+        walk_snapshot(data, st.st_size, true, NULL);
+    munmap((void *)data, st.st_size);
+    return usable;
+}
+
+/**
+ * Loads the rc file, or restores the state it set up from its snapshot. A snapshot is only written
+ * when the rc file did nothing but set up state (it started no programs), since restoring it skips
+ * whatever the rc file's commands would otherwise have done.
+ */
+static void load_rc(void)
+{
+    char buf[PATH_MAX];
+    const char *path = rc_path(buf, sizeof(buf));
+    struct stat rc;
+    if (!path || stat(path, &rc) == -1)
+        return;
+    char snapshot[PATH_MAX + 16];
+    snprintf(snapshot, sizeof(snapshot), "%s.snapshot", path);
+    struct snapshot_header header;
+    snapshot_header(&header, &rc);
+    if (restore_snapshot(snapshot, &header))
+        return;
+
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        perror(path);
+        return;
+    }
+    // The snapshot can only stand in for the rc file if all it did was set up state: no programs or
+    // background jobs, and no builtins other than cd, set and alias or with redirections.
+    unsigned long forks = stats.spawns_fork + stats.spawn_failures, builtins = unsnapshotted_builtins;
+    char *start_cwd = getcwd(NULL, 0);
+    char *line = NULL;
+    size_t cap = 0;
+    env_reads.active = true;
+    while (getline(&line, &cap, file) != -1)
+    {
+        if (line[strspn(line, " \t")] != '#')
+            parse_cmd(line);
+    }
+    env_reads.active = false;
+    free(line);
+    fclose(file);
+    header.env_hash = env_reads.hash;
+    if (stats.spawns_fork + stats.spawn_failures == forks && unsnapshotted_builtins == builtins && !job_table)
+        save_snapshot(snapshot, &header, start_cwd);
+    free(start_cwd);
+    for (size_t i = 0; i < env_reads.len; i++)
+        free(env_reads.names[i]);
+    free(env_reads.names);
+    env_reads = (struct env_reads){0};
+}
+
+/**
+ * Appends a segment to the compiled prompt.
+ */
+static void push_prompt_segment(enum prompt_segment_kind kind, const char *text)
+{
+    prompt.segments = realloc(prompt.segments, (prompt.num_segments + 1) * sizeof(struct prompt_segment));
+    if (!prompt.segments)
+    {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+    }
+    prompt.segments[prompt.num_segments].kind = kind;
+    prompt.segments[prompt.num_segments++].text = text ? strdup(text) : NULL;
+}
+
+/**
+ * Compiles a PS1 value into the prompt's segment list. Escapes: \w working directory, \W its last
+ * component, \u user, \h host, \? status of the last command, \j number of background jobs, \t time
+ * (HH:MM:SS), \g git branch, \$ '#' for root and '$' otherwise, \n newline, \nnn the character with
+ * octal code nnn (except NUL), \\ backslash. The user, the host and all other text never change, so they are
+ * resolved here into literal segments.
+ */
+static void compile_prompt(const char *ps1)
+{
+    for (size_t i = 0; i < prompt.num_segments; i++)
+        free(prompt.segments[i].text);
+    free(prompt.segments);
+    free(prompt.source);
+    prompt.segments = NULL;
+    prompt.num_segments = 0;
+    prompt.source = strdup(ps1);
+
+    struct strbuf literal = {0};
+    strbuf_append(&literal, "", 0);
+    for (const char *p = ps1; *p; p++)
+    {
+        if (*p != '\\' || !p[1])
+        {
+            strbuf_append(&literal, p, 1);
+            continue;
+        }
+        enum prompt_segment_kind kind;
+        char host[256] = "", code = 0;
+        struct passwd *pw;
+        const char *escape = p;
+        switch (*++p)
+        {
+        case 'w':
+            kind = PROMPT_CWD;
+            break;
+        case 'W':
+            kind = PROMPT_CWD_BASE;
+            break;
+        case '?':
+            kind = PROMPT_STATUS;
+            break;
+        case 'j':
+            kind = PROMPT_JOBS;
+            break;
+        case 't':
+            kind = PROMPT_TIME;
+            break;
+        case 'g':
+            kind = PROMPT_GIT_BRANCH;
+            break;
+        case 'u':
+            pw = getpwuid(geteuid());
+            strbuf_appendf(&literal, "%s", pw ? pw->pw_name : "?");
+            continue;
+        case 'h':
+            gethostname(host, sizeof(host) - 1);
+            strbuf_append(&literal, host, strcspn(host, "."));
+            continue;
+        case '$':
+            strbuf_append(&literal, geteuid() == 0 ? "#" : "$", 1);
+            continue;
+        case 'n':
+            strbuf_append(&literal, "\n", 1);
+            continue;
+        case '\\':
+            strbuf_append(&literal, "\\", 1);
+            continue;
+        case '0' ... '7': // An octal character code, such as \040 for the space words cannot contain.
+            for (int digits = 0; digits < 3 && *p >= '0' && *p <= '7'; digits++)
+                code = code * 8 + (*p++ - '0');
+            if (code)
+                strbuf_append(&literal, &code, 1);
+            else
+                strbuf_append(&literal, escape, p - escape); // A NUL would end the literal; it stays as typed.
+            p--;
+            continue;
+        default:
+            strbuf_append(&literal, p - 1, 2); // Unknown escapes stay as typed.
+            continue;
+        }
+        if (literal.len > 0)
+            push_prompt_segment(PROMPT_LITERAL, literal.data);
+        literal.len = 0;
+        push_prompt_segment(kind, NULL);
+    }
+    if (literal.len > 0)
+        push_prompt_segment(PROMPT_LITERAL, literal.data);
+    free(literal.data);
+}
+
+/**
+ * Finds the branch checked out in the git repository containing a directory by reading its HEAD,
+ * following the "gitdir:" file of worktrees and submodules.
+ *
+ * @param dir The directory.
+ * @param branch Receives the branch, the short commit hash of a detached HEAD, or "" outside a repository.
+ */
+static void read_git_branch(const char *dir, char branch[PROMPT_BRANCH_MAX])
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", dir);
+    branch[0] = '\0';
+    while (1)
+    {
+        char head[PATH_MAX + 16], line[PATH_MAX];
+        snprintf(head, sizeof(head), "%s/.git", path);
+        FILE *file = fopen(head, "r");
+        bool gitdir = false; // .git is a file naming the real git directory.
+        if (file)
+        {
+            gitdir = fgets(line, sizeof(line), file) && strncmp(line, "gitdir: ", 8) == 0;
+            fclose(file);
+        }
+        int len;
+        if (gitdir)
+            line[strcspn(line, "\n")] = '\0';
+        if (gitdir && line[8] == '/')
+            len = snprintf(head, sizeof(head), "%s/HEAD", line + 8);
+        else if (gitdir)
+            len = snprintf(head, sizeof(head), "%s/%s/HEAD", path, line + 8);
+        else
+            len = snprintf(head, sizeof(head), "%s/.git/HEAD", path);
+        file = len < (int)sizeof(head) ? fopen(head, "r") : NULL;
+        if (file)
+        {
+            if (fgets(line, sizeof(line), file))
+            {
+                line[strcspn(line, "\n")] = '\0';
+                const char *ref = strncmp(line, "ref: refs/heads/", 16) == 0 ? line + 16 : NULL;
+                snprintf(branch, PROMPT_BRANCH_MAX, "%.*s", ref ? PROMPT_BRANCH_MAX - 1 : 7, ref ? ref : line);
+            }
+            fclose(file);
+            return;
+        }
+        char *slash = strrchr(path, '/');
+        if (!slash || slash == path)
+            return;
+        *slash = '\0';
+    }
+}
+
+/**
+ * Thread pool task refreshing the cached git branch of a directory.
+ */
+static void git_branch_task(void *arg)
+{
+    struct branch_entry *entry = arg;
+    char branch[PROMPT_BRANCH_MAX];
+    read_git_branch(entry->dir, branch); // The entry's directory does not change while it is pending.
+    pthread_mutex_lock(&branch_cache.lock);
+    memcpy(entry->branch, branch, sizeof(branch));
+    entry->valid = true;
+    entry->pending = false;
+    pthread_cond_broadcast(&branch_cache.done);
+    pthread_mutex_unlock(&branch_cache.lock);
+}
+
+/**
+ * Looks up the git branch of a directory for the prompt. The branch is read on the thread pool and
+ * cached per directory until a command runs, since any command may check out another branch. The prompt
+ * waits for a read at most PROMPT_DEADLINE_MS and shows the cached branch, if any, when the
+ * repository is slower than that.
+ *
+ * @param dir The directory.
+ * @param branch Receives the branch, or "" if it is unknown.
+ */
+static void prompt_git_branch(const char *dir, char branch[PROMPT_BRANCH_MAX])
+{
+    pthread_mutex_lock(&branch_cache.lock);
+    struct branch_entry *entry = NULL, *victim = NULL;
+    for (size_t i = 0; i < PROMPT_BRANCH_DIRS && !entry; i++)
+    {
+        struct branch_entry *candidate = &branch_cache.entries[i];
+        if (strcmp(candidate->dir, dir) == 0)
+            entry = candidate;
+        else if (!candidate->pending && (!victim || candidate->last_used < victim->last_used))
+            victim = candidate;
+    }
+    if (!entry && victim && strlen(dir) < sizeof(victim->dir))
+    {
+        entry = victim;
+        strcpy(entry->dir, dir);
+        entry->valid = false;
+    }
+    branch[0] = '\0';
+    if (!entry)
+    {
+        pthread_mutex_unlock(&branch_cache.lock);
+        return;
+    }
+    entry->last_used = ++branch_cache.uses;
+    if (!entry->pending && (!entry->valid || entry->commands != stats.commands_parsed))
+    {
+        entry->pending = true;
+        entry->commands = stats.commands_parsed;
+        pthread_mutex_unlock(&branch_cache.lock); // Without workers the task runs right away.
+        pool_submit(git_branch_task, entry, 0, true);
+        pthread_mutex_lock(&branch_cache.lock);
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += PROMPT_DEADLINE_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while (entry->pending && pthread_cond_timedwait(&branch_cache.done, &branch_cache.lock, &deadline) == 0)
+        ;
+    if (entry->valid)
+        memcpy(branch, entry->branch, PROMPT_BRANCH_MAX);
+    pthread_mutex_unlock(&branch_cache.lock);
+}
+
+/**
+ * Renders the prompt described by PS1, recompiling it whenever PS1 has changed.
+ */
+static void render_prompt(struct strbuf *out)
+{
+    const char *ps1 = get_var("PS1");
+    if (!ps1)
+        ps1 = PROMPT_DEFAULT;
+    if (!prompt.source || strcmp(prompt.source, ps1) != 0)
+        compile_prompt(ps1);
+    strbuf_append(out, "", 0);
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        strcpy(cwd, "?");
+    for (size_t i = 0; i < prompt.num_segments; i++)
+    {
+        const struct prompt_segment *segment = &prompt.segments[i];
+        size_t jobs = 0;
+        time_t now;
+        char text[PROMPT_BRANCH_MAX];
+        switch (segment->kind)
+        {
+        case PROMPT_LITERAL:
+            strbuf_appendf(out, "%s", segment->text);
+            break;
+        case PROMPT_CWD:
+            strbuf_appendf(out, "%s", cwd);
+            break;
+        case PROMPT_CWD_BASE:
+            strbuf_appendf(out, "%s", strcmp(cwd, "/") == 0 || !strrchr(cwd, '/') ? cwd : strrchr(cwd, '/') + 1);
+            break;
+        case PROMPT_STATUS:
+            strbuf_appendf(out, "%d", last_status);
+            break;
+        case PROMPT_JOBS:
+            for (struct job *job = job_table; job; job = job->next)
+                jobs += !job->on_finish;
+            strbuf_appendf(out, "%zu", jobs);
+            break;
+        case PROMPT_TIME:
+            now = time(NULL);
+            strftime(text, sizeof(text), "%H:%M:%S", localtime(&now));
+            strbuf_appendf(out, "%s", text);
+            break;
+        case PROMPT_GIT_BRANCH:
+            prompt_git_branch(cwd, text);
+            strbuf_appendf(out, "%s", text);
+            break;
+        }
+    }
+}
+
+/**
+ * Cursor of the small JSON reader used for machine-mode requests.
+ */
+struct json_reader
+{
+    const char *p;
+    const char *error; // First error met, or NULL.
+};
+
+static void json_skip_space(struct json_reader *json)
+{
+    while (isspace((unsigned char)*json->p))
+        json->p++;
+}
+
+/**
+ * Consumes the given character after optional whitespace.
+ *
+ * @return false if the next character is something else.
+ */
+static bool json_accept(struct json_reader *json, char c)
+{
+    json_skip_space(json);
+    if (*json->p != c)
+        return false;
+    json->p++;
+    return true;
+}
+
+/**
+ * Reads a JSON string, decoding its escapes.
+ *
+ * @param json The reader.
+ * @return A newly allocated string, or NULL on errors (json->error is set).
+ */
+static char *json_read_string(struct json_reader *json)
+{
+    if (!json_accept(json, '"'))
+    {
+        json->error = "expected a string";
+        return NULL;
+    }
+    struct strbuf out = {0};
+    strbuf_append(&out, "", 0);
+    while (*json->p != '"')
+    {
+        char c = *json->p++;
+        if (c == '\0')
+        {
+            json->error = "unterminated string";
+            free(out.data);
+            return NULL;
+        }
+        if (c != '\\')
+        {
+            strbuf_append(&out, &c, 1);
+            continue;
+        }
+        c = *json->p++;
+        const char *letters = "bfnrt", *controls = "\b\f\n\r\t";
+        const char *letter = c ? strchr(letters, c) : NULL;
+        unsigned code;
+        if (c == '"' || c == '\\' || c == '/')
+        {
+            strbuf_append(&out, &c, 1);
+        }
+        else if (letter)
+        {
+            strbuf_append(&out, &controls[letter - letters], 1);
+        }
+        else if (c == 'u' && sscanf(json->p, "%4x", &code) == 1 && code > 0)
+        {
+            json->p += 4;
+            char utf8[3]; // Characters of the Basic Multilingual Plane, as UTF-8.
+            if (code < 0x80)
+                strbuf_appendf(&out, "%c", code);
+            else if (code < 0x800)
+            {
+                utf8[0] = 0xc0 | (code >> 6);
+                utf8[1] = 0x80 | (code & 0x3f);
+                strbuf_append(&out, utf8, 2);
+            }
+            else
+            {
+                utf8[0] = 0xe0 | (code >> 12);
+                utf8[1] = 0x80 | ((code >> 6) & 0x3f);
+                utf8[2] = 0x80 | (code & 0x3f);
+                strbuf_append(&out, utf8, 3);
+            }
+        }
+        else
+        {
+            json->error = "invalid escape in string";
+            free(out.data);
+            return NULL;
+        }
+    }
+    json->p++;
+    return out.data;
+}
+
+/**
+ * Skips any JSON value.
+ *
+ * @return false on errors (json->error is set).
+ */
+static bool json_skip_value(struct json_reader *json)
+{
+    json_skip_space(json);
+    char open = *json->p;
+    if (open == '"')
+    {
+        free(json_read_string(json));
+        return !json->error;
+    }
+    if (open == '{' || open == '[')
+    {
+        char close = open == '{' ? '}' : ']';
+        json->p++;
+        if (json_accept(json, close))
+            return true;
+        do
+        {
+            if (open == '{')
+            {
+                free(json_read_string(json));
+                if (json->error || !json_accept(json, ':'))
+                    break;
+            }
+            if (!json_skip_value(json))
+                return false;
+        } while (json_accept(json, ','));
+        if (json->error || !json_accept(json, close))
+        {
+            json->error = json->error ? json->error : "malformed object or array";
+            return false;
+        }
+        return true;
+    }
+    const char *start = json->p;
+    while (*json->p && (isalnum((unsigned char)*json->p) || strchr("+-.", *json->p)))
+        json->p++;
+    if (json->p == start)
+    {
+        json->error = "expected a value";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Whether a value skipped by json_skip_value is a string, a number or null, which an id may be.
+ */
+static bool json_scalar_id(const char *value, size_t len)
+{
+    if (*value == '"' || (len == 4 && strncmp(value, "null", 4) == 0))
+        return true;
+    // A JSON number: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+    const char *p = value + (*value == '-'), *end = value + len;
+    if (p == end || !isdigit((unsigned char)*p) || (*p == '0' && p + 1 < end && isdigit((unsigned char)p[1])))
+        return false;
+    while (p < end && isdigit((unsigned char)*p))
+        p++;
+    if (p < end && *p == '.')
+    {
+        if (++p == end || !isdigit((unsigned char)*p))
+            return false;
+        while (p < end && isdigit((unsigned char)*p))
+            p++;
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        p += p + 1 < end && (p[1] == '+' || p[1] == '-') ? 2 : 1;
+        if (p == end || !isdigit((unsigned char)*p))
+            return false;
+        while (p < end && isdigit((unsigned char)*p))
+            p++;
+    }
+    return p == end;
+}
+
+/**
+ * Releases a machine-mode request.
+ *
+ * @param request The request to free.
+ */
+static void free_request(struct machine_request *request)
+{
+    if (request->timer_fd != -1)
+    {
+        ev_remove(request->timer_fd);
+        close(request->timer_fd);
+    }
+    for (size_t i = 0; i < request->argc; i++)
+        free(request->argv[i]);
+    for (size_t i = 0; i < request->num_env; i++)
+        free(request->env[i]);
+    free(request->argv);
+    free(request->env);
+    free(request->id);
+    free(request->cmd);
+    free(request->cwd);
+    free(request);
+}
+
+/**
+ * Appends a string to a growing NULL terminated array.
+ */
+static void push_string(char ***array, size_t *len, char *str)
+{
+    *array = realloc(*array, (*len + 2) * sizeof(char *));
+    if (!*array)
+    {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+    }
+    (*array)[(*len)++] = str;
+    (*array)[*len] = NULL;
+}
+
+/**
+ * Parses one machine-mode request: a JSON object with an "id" (any JSON value, echoed back), either
+ * "cmd" (a command line) or "argv" (an array of words run without further parsing), and optionally
+ * "cwd", "env" (an object of variables to set) and "timeout" (seconds). Unknown keys are ignored.
+ *
+ * @param line The request line.
+ * @param error Set to a description of the problem if the request is invalid.
+ * @param id Set to the request's id as raw JSON, newly allocated, or left NULL if it has none.
+ * @return The request, or NULL if it is invalid. Its id is set whenever it could be read.
+ */
+static struct machine_request *parse_request(const char *line, const char **error, char **id)
+{
+    struct machine_request *request = calloc(1, sizeof(struct machine_request));
+    if (!request)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    request->timer_fd = -1;
+    struct json_reader json = {line, NULL};
+    if (!json_accept(&json, '{'))
+        json.error = "expected a JSON object";
+    bool empty = !json.error && json_accept(&json, '}');
+    while (!json.error && !empty)
+    {
+        char *key = json_read_string(&json);
+        if (!key || !json_accept(&json, ':'))
+        {
+            json.error = json.error ? json.error : "expected ':'";
+            free(key);
+            break;
+        }
+        json_skip_space(&json);
+        if (strcmp(key, "id") == 0)
+        {
+            const char *start = json.p;
+            if (json_skip_value(&json) && json_scalar_id(start, json.p - start))
+            {
+                free(*id);
+                *id = strndup(start, json.p - start);
+            }
+            else if (!json.error)
+                json.error = "id must be a string, a number or null"; // Anything else is echoed back.
+        }
+        else if (strcmp(key, "cmd") == 0 || strcmp(key, "cwd") == 0)
+        {
+            char **field = key[1] == 'm' ? &request->cmd : &request->cwd;
+            free(*field);
+            *field = json_read_string(&json);
+        }
+        else if (strcmp(key, "argv") == 0 && json_accept(&json, '['))
+        {
+            if (!json_accept(&json, ']'))
+            {
+                do
+                {
+                    char *word = json_read_string(&json);
+                    if (word)
+                        push_string(&request->argv, &request->argc, word);
+                } while (!json.error && json_accept(&json, ','));
+                if (!json.error && !json_accept(&json, ']'))
+                    json.error = "expected ']'";
+            }
+        }
+        else if (strcmp(key, "env") == 0 && json_accept(&json, '{'))
+        {
+            if (!json_accept(&json, '}'))
+            {
+                do
+                {
+                    char *name = json_read_string(&json);
+                    char *value = name && json_accept(&json, ':') ? json_read_string(&json) : NULL;
+                    if (value)
+                    {
+                        struct strbuf var = {0};
+                        strbuf_appendf(&var, "%s=%s", name, value);
+                        push_string(&request->env, &request->num_env, var.data);
+                    }
+                    else if (!json.error)
+                        json.error = "expected ':'";
+                    free(name);
+                    free(value);
+                } while (!json.error && json_accept(&json, ','));
+                if (!json.error && !json_accept(&json, '}'))
+                    json.error = "expected '}'";
+            }
+        }
+        else if (strcmp(key, "timeout") == 0)
+        {
+            char *end;
+            request->timeout = strtod(json.p, &end);
+            if (end == json.p || request->timeout < 0)
+                json.error = "timeout must be a number of seconds";
+            json.p = end;
+        }
+        else if (strcmp(key, "argv") == 0 || strcmp(key, "env") == 0)
+        {
+            json.error = "argv must be an array and env an object";
+        }
+        else
+        {
+            json_skip_value(&json);
+        }
+        free(key);
+        if (json.error || json_accept(&json, '}'))
+            break;
+        if (!json_accept(&json, ','))
+            json.error = "expected ',' or '}'";
+    }
+    if (!json.error && !request->cmd == !request->argv)
+        json.error = "exactly one of cmd and argv is required";
+    if (!json.error && request->argv && request->argc == 0)
+        json.error = "argv is empty";
+    if (json.error)
+    {
+        *error = json.error;
+        free_request(request);
+        return NULL;
+    }
+    return request;
+}
+
+/**
+ * Whether a request sets PATH, in which case its programs are looked up by execvp in the child rather
+ * than through the shell's PATH cache.
+ */
+static bool overrides_path(const struct machine_request *request)
+{
+    for (size_t i = 0; request && i < request->num_env; i++)
+    {
+        if (strncmp(request->env[i], "PATH=", 5) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Applies a request's directory and environment in a freshly forked stage, before its redirections.
+ */
+static bool apply_request(const struct machine_request *request)
+{
+    if (request->cwd && chdir(request->cwd) == -1)
+    {
+        perror(request->cwd);
+        return false;
+    }
+    for (size_t i = 0; i < request->num_env; i++)
+        putenv(request->env[i]);
+    return true;
+}
+
+/**
+ * Writes one result line to standard output.
+ */
+static void emit_result(struct strbuf *result)
+{
+    strbuf_append(result, "\n", 1);
+    write_all(STDOUT_FILENO, result->data, result->len);
+    free(result->data);
+}
+
+/**
+ * Reports a request that could not be run.
+ *
+ * @param id The request's id as raw JSON, or NULL if unknown.
+ * @param error What was wrong.
+ */
+static void emit_request_error(const char *id, const char *error)
+{
+    struct strbuf result = {0};
+    strbuf_appendf(&result, "{\"id\":%s,\"status\":2,\"error\":", id ? id : "null");
+    strbuf_append_json(&result, error);
+    strbuf_append(&result, "}", 1);
+    emit_result(&result);
+}
+
+/**
+ * Event loop callback for a request's timeout: kills every stage still running, together with any
+ * processes they started, which would otherwise hold the capture pipes open and delay the result.
+ */
+static void request_timeout(int fd, short revents, void *data)
+{
+    struct job *job = data;
+    drain_timer(fd);
+    ev_remove(fd);
+    close(fd);
+    job->request->timer_fd = -1;
+    job->request->timed_out = true;
+    if (job->request->pgid > 0)
+        kill(-job->request->pgid, SIGKILL); // Finished stages may have left processes behind, too.
+    for (size_t i = 0; i < job->num_stages; i++)
+    {
+        struct stage *stage = &job->stages[i];
+        if (stage->finished)
+            continue;
+        if (stage->pid > 0)
+            kill(stage->pid, SIGKILL); // In case it could not join the group.
+        else if (stage->pid == 0 && stage->limiter && !stage->limiter->done)
+            finish_rate_limiter(stage->limiter, 128 + SIGKILL);
+    }
+}
+
+/**
+ * Starts the job of a machine-mode request. Jobs run concurrently; submit_request returns as soon as
+ * the stages are started, and the result is written once the job finishes.
+ *
+ * @param line The request line.
+ */
+static void submit_request(const char *line)
+{
+    const char *error = NULL;
+    char *id = NULL;
+    struct machine_request *request = parse_request(line, &error, &id);
+    if (!request)
+    {
+        emit_request_error(id, error);
+        free(id);
+        return;
+    }
+    request->id = id ? id : strdup("null");
+    struct stat dir;
+    if (request->cwd && (stat(request->cwd, &dir) == -1 || !S_ISDIR(dir.st_mode)))
+    {
+        emit_request_error(request->id, "cwd is not a directory");
+        free_request(request);
+        return;
+    }
+
+    size_t num_stages = 1;
+    struct stage *stages;
+    char *cmdline;
+    if (request->cmd)
+    {
+        struct parse_entry *line = acquire_parse_entry(request->cmd, false);
+        size_t num_words = line->num_words;
+        if (num_words > 0 && strcmp(line->words[num_words - 1], "&") == 0)
+            num_words--; // Every request runs in the background anyway.
+        stages = num_words > 0 ? line_stages(line, num_words, line->words, &num_stages) : NULL;
+        cmdline = join_args(num_words, line->words);
+        release_parse_entry(line);
+    }
+    else
+    {
+        stages = calloc(1, sizeof(struct stage));
+        if (!stages)
+        {
+            perror("calloc failed");
+            exit(EXIT_FAILURE);
+        }
+        stages[0].argv = calloc(request->argc + 1, sizeof(char *));
+        for (size_t i = 0; i < request->argc; i++)
+            stages[0].argv[i] = strdup(request->argv[i]);
+        stages[0].argc = request->argc;
+        stages[0].pid = -1;
+        stages[0].pidfd = -1;
+        stages[0].exec_fd = -1;
+        cmdline = join_args(request->argc, request->argv);
+    }
+    if (!stages)
+    {
+        emit_request_error(request->id, "syntax error");
+        free(cmdline);
+        free_request(request);
+        return;
+    }
+
+    struct job *job = create_job(cmdline, stages, num_stages, request->cwd);
+    job->background = true;
+    job->request = request;
+    job->on_finish = finish_request;
+    if (request->timeout > 0)
+    {
+        long timeout_ms = request->timeout * 1000;
+        request->timer_fd = create_timer(timeout_ms > 0 ? timeout_ms : 1);
+        if (request->timer_fd != -1)
+            ev_add(request->timer_fd, POLLIN, request_timeout, job);
+    }
+    execute_pipe(job);
+}
+
+/**
+ * on_finish callback of machine-mode jobs: writes the result with overall and per-stage exit
+ * statuses, timings, resource usage and the captured output.
+ *
+ * @param job The finished job.
+ * @param status The job's exit status.
+ */
+static void finish_request(struct job *job, int status, void *data)
+{
+    const struct timespec *end = &job->finished;
+    double wall_ms = (end->tv_sec - job->started.tv_sec) * 1e3 + (end->tv_nsec - job->started.tv_nsec) / 1e6;
+    struct strbuf result = {0};
+    strbuf_appendf(&result, "{\"id\":%s,\"status\":%d,\"timed_out\":%s,\"start\":%ld.%03ld,\"wall_ms\":%.3f",
+                   job->request->id, status, job->request->timed_out ? "true" : "false",
+                   (long)job->submitted.tv_sec, job->submitted.tv_nsec / 1000000, wall_ms);
+    strbuf_append(&result, ",\"stages\":[", 11);
+    for (size_t i = 0; i < job->num_stages; i++)
+    {
+        const struct stage *stage = &job->stages[i];
+        const struct rusage *usage = &stage->usage;
+        strbuf_appendf(&result,
+                       "%s{\"pid\":%d,\"status\":%d,\"signal\":%d,\"utime_ms\":%.3f,\"stime_ms\":%.3f,"
+                       "\"maxrss_kb\":%ld}",
+                       i ? "," : "", (int)stage->pid, stage->status, stage->signal,
+                       usage->ru_utime.tv_sec * 1e3 + usage->ru_utime.tv_usec / 1e3,
+                       usage->ru_stime.tv_sec * 1e3 + usage->ru_stime.tv_usec / 1e3, usage->ru_maxrss);
+    }
+    strbuf_append(&result, "]", 1);
+    const char *names[2] = {"stdout", "stderr"};
+    for (size_t i = 0; i < 2; i++)
+    {
+        const struct output_relay *relay = job->relays[i];
+        strbuf_appendf(&result, ",\"%s\":", names[i]);
+        strbuf_append_json(&result, relay && relay->pending.data ? relay->pending.data : "");
+        if (relay && relay->truncated)
+            strbuf_appendf(&result, ",\"%s_truncated\":true", names[i]);
+    }
+    strbuf_append(&result, "}", 1);
+    emit_result(&result);
+}
+
+/**
+ * Machine mode (--machine): instead of prompting, reads one JSON request per line from standard
+ * input and writes one JSON result per line to standard output as each job finishes. Any number of
+ * requests may be in flight; results come back in completion order, matched by id. Runs until the
+ * input ends and every job has finished.
+ *
+ * @return The shell's exit status.
+ */
+int shell_machine(void)
+{
+    ev_add(STDIN_FILENO, POLLIN, read_input, NULL);
+    bool reading = true;
+    while (1)
+    {
+        char *line;
+        while ((line = next_line()))
+        {
+            if (line[strspn(line, " \t\r\n")] != '\0')
+                submit_request(line);
+            free(line);
+        }
+        if (reading && stdin_reader.eof)
+        {
+            ev_remove(STDIN_FILENO);
+            reading = false;
+        }
+        reap_children();
+        finish_detached_jobs();
+        if (!reading && !job_table)
+            return 0;
+        ev_wait(-1);
+    }
+}
+
+/**
+ * A parsed command line, kept as a template of its stages that every run copies.
+ */
+struct shell_plan
+{
+    char *cmdline;
+    struct stage *stages;
+    size_t num_stages;
+};
+
+/**
+ * A started plan and, once it has finished, its result.
+ */
+struct shell_run
+{
+    shell_done_fn done_fn;
+    void *data;
+    bool done;
+    struct shell_result result;
+    struct shell_stage_result *stages;
+};
+
+struct shell_plan *shell_parse(const char *line)
+{
+    char *input = strdup(line);
+    size_t num_words;
+    char **words = split_words(input, &num_words);
+    if (num_words > 0 && strcmp(words[num_words - 1], "&") == 0)
+        free(words[--num_words]); // Runs never block the caller anyway.
+    struct shell_plan *plan = NULL;
+    size_t num_stages;
+    struct stage *stages = num_words > 0 ? build_stages(num_words, words, &num_stages) : NULL;
+    if (num_words == 0)
+        fprintf(stderr, "Syntax error: empty command\n");
+    if (stages)
+    {
+        plan = malloc(sizeof(struct shell_plan));
+        if (!plan)
+        {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        plan->cmdline = join_args(num_words, words);
+        plan->stages = stages;
+        plan->num_stages = num_stages;
+    }
+    for (size_t i = 0; i < num_words; i++)
+        free(words[i]);
+    free(words);
+    free(input);
+    return plan;
+}
+
+size_t shell_plan_stages(const struct shell_plan *plan)
+{
+    return plan->num_stages;
+}
+
+void shell_plan_free(struct shell_plan *plan)
+{
+    free_stages(plan->stages, plan->num_stages);
+    free(plan->cmdline);
+    free(plan);
+}
+
+/**
+ * Makes a fresh, not yet started copy of a plan's stages.
+ */
+static struct stage *copy_stages(const struct shell_plan *plan)
+{
+    struct stage *stages = calloc(plan->num_stages, sizeof(struct stage));
+    if (!stages)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t s = 0; s < plan->num_stages; s++)
+    {
+        const struct stage *from = &plan->stages[s];
+        struct stage *to = &stages[s];
+        to->argv = calloc(from->argc + 1, sizeof(char *));
+        if (!to->argv)
+        {
+            perror("calloc failed");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < from->argc; i++)
+            to->argv[i] = strdup(from->argv[i]);
+        to->argc = from->argc;
+        to->input_file = from->input_file ? strdup(from->input_file) : NULL;
+        to->output_file = from->output_file ? strdup(from->output_file) : NULL;
+        to->pid = -1;
+        to->pidfd = -1;
+        to->exec_fd = -1;
+    }
+    return stages;
+}
+
+/**
+ * on_finish callback of library runs: keeps the result in the run and calls its completion callback.
+ */
+static void finish_run(struct job *job, int status, void *data)
+{
+    struct shell_run *run = data;
+    run->stages = calloc(job->num_stages, sizeof(struct shell_stage_result));
+    if (!run->stages)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < job->num_stages; i++)
+    {
+        run->stages[i] = (struct shell_stage_result){job->stages[i].pid, job->stages[i].status,
+                                                     job->stages[i].signal, job->stages[i].usage};
+    }
+    run->result.status = status;
+    run->result.num_stages = job->num_stages;
+    run->result.stages = run->stages;
+    run->result.wall_ms =
+        (job->finished.tv_sec - job->started.tv_sec) * 1e3 + (job->finished.tv_nsec - job->started.tv_nsec) / 1e6;
+    run->done = true;
+    if (run->done_fn)
+        run->done_fn(run, &run->result, run->data);
+}
+
+struct shell_run *shell_start(const struct shell_plan *plan, int in_fd, int out_fd, int err_fd, shell_done_fn done,
+                              void *data)
+{
+    struct shell_run *run = calloc(1, sizeof(struct shell_run));
+    if (!run)
+    {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    run->done_fn = done;
+    run->data = data;
+    struct job *job = create_job(strdup(plan->cmdline), copy_stages(plan), plan->num_stages, NULL);
+    job->background = true; // Input from /dev/null unless in_fd is given.
+    job->fds[0] = in_fd;
+    job->fds[1] = out_fd;
+    job->fds[2] = err_fd;
+    job->on_finish = finish_run;
+    job->finish_data = run;
+    execute_pipe(job);
+    return run;
+}
+
+void shell_poll(int timeout_ms)
+{
+    finish_detached_jobs(); // Runs whose stages all failed to start are finished already.
+    ev_wait(timeout_ms);
+    finish_detached_jobs();
+}
+
+const struct shell_result *shell_wait(struct shell_run *run)
+{
+    while (!run->done)
+        shell_poll(-1);
+    return &run->result;
+}
+
+bool shell_done(const struct shell_run *run)
+{
+    return run->done;
+}
+
+void shell_run_free(struct shell_run *run)
+{
+    free(run->stages);
+    free(run);
+}
+
+int shell_system(const char *line)
+{
+    struct shell_plan *plan = shell_parse(line);
+    if (!plan)
+        return 2;
+    struct shell_run *run = shell_start(plan, STDIN_FILENO, -1, -1, NULL, NULL);
+    int status = shell_wait(run)->status;
+    shell_run_free(run);
+    shell_plan_free(plan);
+    return status;
+}
+
+bool shell_export_metrics(const char *file, const char *socket_path, double interval)
+{
+    return export_metrics(file, socket_path, interval);
+}
+
+void shell_prompt(void)
+{
+    struct strbuf out = {0};
+    render_prompt(&out);
+    fputs(out.data, stdout);
+    fflush(stdout);
+    free(out.data);
+}
+
+void shell_load_rc(void)
+{
+    load_rc();
+}
+
+bool shell_open_audit_log(const char *path)
+{
+    return open_audit_log(path);
+}
+
+bool shell_record(const char *path)
+{
+    return open_recording(path);
+}
+
+void shell_notify(void)
+{
+    notify_jobs();
+}
+
+char *shell_read_line(void)
+{
+    if (options.prefetch)
+        prefetch_next_command(); // Warm the likely next command while the user types.
+    return read_command_line();
+}
+
+void shell_execute(char *line)
+{
+    run_recorded(line);
+}
+
+void shell_help(void)
+{
+    execute_help();
+}
+
+void shell_cleanup(void)
+{
+    free(pipe_status);
+    pipe_status = NULL;
+}
@@ -0,0 +1,210 @@
+/**
+ * libshell: the shell's parser and pipeline executor as a library, so that programs can run command
+ * lines without starting /bin/sh for each one, and the front end of the shell itself (main.c).
+ *
+ * A command line is parsed once into a plan, which can then be started any number of times, each
+ * run with its own standard descriptors. Runs proceed concurrently; the caller either waits for a
+ * run or drives the library with shell_poll() and gets an asynchronous completion callback. The
+ * library keeps one shell state per process (variables, options, the job table and the event loop),
+ * so its functions must all be called from the same thread.
+ *
+ * Build the library via make lib, giving build/release/libshell.a (link with -pthread -ldl)
+ *
+ * @author Alex Jasper
+ * @version 04/22/2024
+ */
+
+#ifndef SHELL_H
+#define SHELL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A parsed command line: its pipeline stages with their redirections, ready to run.
+ */
+struct shell_plan;
+
+/**
+ * A started plan.
+ */
+struct shell_run;
+
+/**
+ * How one stage of a run ended.
+ */
+struct shell_stage_result
+{
+    pid_t pid;           // Process that ran the stage, 0 if it ran inside the shell, -1 if never started.
+    int status;          // Exit status, or 128 + signal number if the stage was killed.
+    int signal;          // Signal that terminated the stage, or 0.
+    struct rusage usage; // Resources used by the stage's process.
+};
+
+/**
+ * How a run ended.
+ */
+struct shell_result
+{
+    int status;                               // Status of the pipeline, as $? would be.
+    size_t num_stages;
+    const struct shell_stage_result *stages; // Valid until the run is freed.
+    double wall_ms;                           // Time from start to the end of the last stage.
+};
+
+/**
+ * Called by shell_poll() or shell_wait() when a run finishes.
+ */
+typedef void (*shell_done_fn)(struct shell_run *run, const struct shell_result *result, void *data);
+
+/**
+ * Parses a command line into a plan. Variables are expanded when the plan is parsed.
+ *
+ * @param line The command line, such as "sort < in.txt | uniq -c".
+ * @return The plan, or NULL on a syntax error (an error has been printed).
+ */
+struct shell_plan *shell_parse(const char *line);
+
+/**
+ * @return The number of pipeline stages of a plan.
+ */
+size_t shell_plan_stages(const struct shell_plan *plan);
+
+void shell_plan_free(struct shell_plan *plan);
+
+/**
+ * Starts a plan. Returns as soon as every stage has been started.
+ *
+ * @param plan The plan; it may be freed or started again right away.
+ * @param in_fd Standard input of the first stage, or -1 for /dev/null.
+ * @param out_fd Standard output of the last stage, or -1 to inherit the caller's.
+ * @param err_fd Standard error of every stage, or -1 to inherit the caller's.
+ * @param done Called once the run has finished, or NULL.
+ * @param data Passed to done.
+ * @return The run, to be freed by the caller with shell_run_free() once it has finished.
+ */
+struct shell_run *shell_start(const struct shell_plan *plan, int in_fd, int out_fd, int err_fd, shell_done_fn done,
+                              void *data);
+
+/**
+ * Processes events for up to timeout_ms milliseconds (-1 to wait for the next event), calling the
+ * completion callbacks of runs that finished.
+ */
+void shell_poll(int timeout_ms);
+
+/**
+ * Waits for a run to finish, processing other runs' events meanwhile.
+ *
+ * @return The run's result, valid until the run is freed.
+ */
+const struct shell_result *shell_wait(struct shell_run *run);
+
+/**
+ * @return Whether a run has finished.
+ */
+bool shell_done(const struct shell_run *run);
+
+/**
+ * Releases a finished run.
+ */
+void shell_run_free(struct shell_run *run);
+
+/**
+ * Runs a command line to completion with the caller's standard descriptors, like system(3) but
+ * without an intermediate shell process.
+ *
+ * @return The command's status as $? would show it, or 2 on a syntax error.
+ */
+int shell_system(const char *line);
+
+/*
+ * The interactive front end.
+ */
+
+/**
+ * Loads the rc file ($SHELLRC, else ~/.shellrc), one command line per line. When the file only sets
+ * up state (variables, aliases, options), that state is saved to <rc>.snapshot, and later shells
+ * restore it from there with one mmap() as long as the file and the environment variables it read
+ * are unchanged.
+ */
+void shell_load_rc(void);
+
+/**
+ * Starts recording every command in an audit log.
+ *
+ * @return false if the log could not be opened (an error has been printed).
+ */
+bool shell_open_audit_log(const char *path);
+
+/**
+ * Starts recording every command line typed, with when it was typed, its working directory, how long
+ * it took and its exit status, for bench/replay.c to play back (see make bench).
+ *
+ * @param path The recording, created or truncated.
+ * @return false if it could not be created (an error has been printed).
+ */
+bool shell_record(const char *path);
+
+/**
+ * Starts exporting the shell's metrics (commands and exit statuses, spawns and their latency, running
+ * jobs, CPU time of children) in Prometheus text format, without ever blocking the shell.
+ *
+ * @param file A file rewritten every interval seconds for node_exporter's textfile collector, or NULL.
+ * @param socket_path A Unix socket answering each connection with an HTTP response, or NULL.
+ * @param interval Seconds between rewrites of the file.
+ * @return false if the export could not be set up (an error has been printed).
+ */
+bool shell_export_metrics(const char *file, const char *socket_path, double interval);
+
+/**
+ * Serves JSON-lines requests on standard input until it ends (the --machine mode).
+ *
+ * @return The exit status for the shell.
+ */
+int shell_machine(void);
+
+/**
+ * Reports background jobs that have finished since the last call.
+ */
+void shell_notify(void);
+
+/**
+ * Prints the prompt described by PS1 (see the help for its escapes).
+ */
+void shell_prompt(void);
+
+/**
+ * Waits for the next command line on standard input while looking after background jobs.
+ *
+ * @return A newly allocated line, or NULL at the end of the input.
+ */
+char *shell_read_line(void);
+
+/**
+ * Executes a command line typed by the user in the foreground.
+ *
+ * @param line The line; it is modified.
+ */
+void shell_execute(char *line);
+
+/**
+ * Prints the list of builtins and supported features.
+ */
+void shell_help(void);
+
+/**
+ * Releases what the shell holds at exit.
+ */
+void shell_cleanup(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
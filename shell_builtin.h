@@ -0,0 +1,81 @@
+/**
+ * The C ABI of loadable builtins, which the shell loads with 'enable -f lib.so name' and runs inside
+ * its own process instead of forking and executing a program.
+ *
+ * A loadable builtin is a shared object exporting a struct shell_builtin named <name>_builtin:
+ *
+ *     #include "shell_builtin.h"
+ *
+ *     static int upper(const struct shell_builtin_api *api, int argc, char *argv[])
+ *     {
+ *         char buf[4096];
+ *         ssize_t n;
+ *         while ((n = read(api->in_fd, buf, sizeof(buf))) > 0)
+ *         {
+ *             for (ssize_t i = 0; i < n; i++)
+ *                 buf[i] = toupper((unsigned char)buf[i]);
+ *             write(api->out_fd, buf, n);
+ *         }
+ *         return 0;
+ *     }
+ *
+ *     const struct shell_builtin upper_builtin = {SHELL_BUILTIN_ABI_VERSION, "upper", upper,
+ *                                                 "upper - convert input to upper case"};
+ *
+ * Build it via gcc -shared -fPIC upper.c -o upper.so
+ *
+ * The shell refuses builtins built against a different SHELL_BUILTIN_ABI_VERSION. Fields are only
+ * ever added at the end of struct shell_builtin_api, and api->size tells a builtin which ones the
+ * running shell provides.
+ *
+ * @author Alex Jasper
+ * @version 04/22/2024
+ */
+
+#ifndef SHELL_BUILTIN_H
+#define SHELL_BUILTIN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHELL_BUILTIN_ABI_VERSION 1
+
+/**
+ * What the shell gives a running builtin.
+ */
+struct shell_builtin_api
+{
+    unsigned abi_version; // SHELL_BUILTIN_ABI_VERSION of the shell.
+    size_t size;          // sizeof(struct shell_builtin_api) in the shell.
+    int in_fd;            // The builtin's standard input, output and error, with redirections applied.
+    int out_fd;
+    int err_fd;
+    const char *(*get_var)(const char *name);              // A shell or environment variable, or NULL.
+    void (*set_var)(const char *name, const char *value); // Sets a shell variable.
+    // Parallel work goes to the shell's thread pool rather than to threads of the builtin's own.
+    // submit queues fn(arg) with a priority from 0 (most urgent) to 2 (background work) and returns
+    // a task that must be passed to wait, which returns once fn has run (running other queued tasks
+    // meanwhile) and releases it.
+    void *(*submit)(void (*fn)(void *arg), void *arg, int priority);
+    void (*wait)(void *task);
+};
+
+/**
+ * A loadable builtin, exported by its shared object as <name>_builtin.
+ */
+struct shell_builtin
+{
+    unsigned abi_version; // SHELL_BUILTIN_ABI_VERSION the builtin was built against.
+    const char *name;
+    int (*run)(const struct shell_builtin_api *api, int argc, char *argv[]); // Returns the exit status.
+    const char *usage;                                                       // Shown by help.
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif